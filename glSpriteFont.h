@@ -5,23 +5,170 @@
     #define glIFR_InterModule __declspec(dllimport)
 #endif // glIFR_InterModule
 
+// glIFontRenderer::getLayoutCacheStats() の結果。hits/misses/evictions は生成時からの累計です
+struct glIFR_LayoutCacheStats
+{
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t entries;     // 現在キャッシュしている文字列の数
+    size_t bytes;       // 現在の使用メモリ量 (概算)
+};
+
+// glIFontRenderer::getFlushStats() の結果。文字を描いた flush() 1 回分です (何もない時の flush() は記録しません)
+struct glIFR_FlushStats
+{
+    size_t glyphs_submitted;    // 描画に回した文字数 (静的テキストを含む)
+    size_t glyphs_drawn;        // 実際に描いた文字数
+    size_t draw_calls;
+    size_t chunks;              // 文字をバッファにまとめて書き込んだ回数
+    size_t bytes_uploaded;      // 頂点/uniform バッファに書き込んだ量
+    size_t map_count;           // map/unmap の回数
+    double add_text_ms;         // 前回の flush() 以降に addText() (builder を含む) に掛かった CPU 時間
+    double flush_ms;            // flush() の CPU 時間
+    double gpu_ms;              // GPU 時間。glIFR_GPUTimer 指定時のみ。結果を待たないので数回前の flush() の値です。取れない時は -1
+    size_t peak_quad_capacity;  // 文字を貯めるバッファの確保数の最大値
+};
+
+// glIFontRenderer::getLoadState() の結果
+enum glIFR_LoadState
+{
+    glIFR_Loading,      // CreateGLSpriteFontAsync() で作ったものが読み込み中
+    glIFR_Ready,
+    glIFR_LoadFailed,   // 読み込みに失敗した。何も描かれません。読み込み中に作った静的テキストは消え、以降の createStaticText() は 0 を返します
+};
+
+class glIFontBuilder;
+
 class glIFR_InterModule glIFontRenderer
 {
 protected:
     virtual ~glIFontRenderer() {}
 public:
     virtual void release()=0;   // 削除はこれで行います
-    virtual void setScreen(float left, float right, float bottom, float top)=0;
+    virtual glIFR_LoadState getLoadState() const=0; // 非同期で作ったもの以外は常に glIFR_Ready
+    virtual void setScreen(float left, float right, float bottom, float top)=0; // 以降に追加する文字に適用されます。追加済みの文字は追加した時のスクリーンのまま描きます
     virtual void setColor(float r, float g, float b, float a)=0;
     virtual void setSize(float size)=0;
     virtual void setSpacing(float space)=0; // 文字幅の倍率
     virtual void setMonospace(bool v)=0; // 等幅にするか
 
-    virtual void addText(float x, float y, const char *text, size_t len=0)=0;   // len==0 だと strlen で自動的に計算します
-    virtual void addText(float x, float y, const wchar_t *text, size_t len=0)=0;// wchar_t 版。こっちの方が速いのでできるだけこっち使いましょう
+    // 以降に追加する文字をこの矩形 (setScreen() と同じ座標系) で切り取ります。glScissor() と違って切り取りは CPU で行うので、
+    // 切り取った文字もそうでない文字と同じ draw call で描かれます。ただし texel 単位なので、境界は最大で半 texel (× 拡大率) ずれます
+    // 縁取りか影を付けた文字だけは描く時に画素単位で切り取るので、矩形が変わる所で draw call が分かれます
+    // 画面外の文字はこれとは関係なく常に捨てられます。静的テキストには適用されません
+    virtual void setClipRect(float left, float top, float right, float bottom)=0;
+    virtual void clearClipRect()=0;
+
+    // 以降に追加する文字と作る静的テキストの layer。flush() では layer の小さいものから描き、同じ layer の中は下の順になります
+    // layer の違う文字を交互に追加しても flush() で並べ替えてまとめるので、draw call は増えません (静的テキストを挟む所だけ分かれます)。既定は 0
+    virtual void setLayer(int layer)=0;
+
+    // 以降に追加する文字と作る静的テキストの縁取りと影。幅と位置は setScreen() と同じ座標系で、色のアルファには文字の色のアルファが掛かります
+    // 塗り、縁取り、影はシェーダで 1 文字 1 回の描画にまとめて描きます。width が 0 以下かアルファが 0 で無効です。既定は両方とも無効
+    // 同じ layer の中は設定が違っても追加した順に重なります (設定が変わる所で draw call が分かれます)。setClipRect() の矩形の外は縁取りも影も描きません
+    virtual void setOutline(float width, float r, float g, float b, float a)=0;
+    virtual void setShadow(float x, float y, float r, float g, float b, float a)=0;
+
+    // addText() で並べた結果を文字列とサイズ、文字間隔、等幅の組み合わせ毎に覚えておき、同じ文字列は平行移動と色の差し替えだけで済ませます
+    // 毎フレーム同じラベルを追加する UI 向け。bytes はメモリ予算で、超えると古いものから捨てます。0 (既定) で無効
+    virtual void setLayoutCacheBudget(size_t bytes)=0;
+    virtual void getLayoutCacheStats(glIFR_LayoutCacheStats &out) const=0;
+
+    virtual void addText(float x, float y, const char *text, size_t len=0)=0;   // text は UTF-8。len==0 だと strlen で自動的に計算します
+    virtual void addText(float x, float y, const wchar_t *text, size_t len=0)=0;// wchar_t 版
+
+    // 静的テキスト。作った時点の色/サイズ/文字間隔/等幅/layer/縁取り/影の設定で並べて GPU 上に置いたままにし、flush() の度に同じ layer の addText() の分より先に描画します
+    // 移動、色変更、表示切り替えでは並べ直しも転送もほとんど発生しません。戻り値はハンドルで、0 は無効な値です
+    virtual int createStaticText(float x, float y, const char *text, size_t len=0)=0;
+    virtual int createStaticText(float x, float y, const wchar_t *text, size_t len=0)=0;
+    virtual void setStaticText(int handle, const char *text, size_t len=0)=0;      // 文字列を差し替えます。サイズ等はこの時点の設定で並べ直します
+    virtual void setStaticText(int handle, const wchar_t *text, size_t len=0)=0;
+    virtual void moveStaticText(int handle, float x, float y)=0;
+    virtual void setStaticTextColor(int handle, float r, float g, float b, float a)=0;
+    virtual void showStaticText(int handle, bool v)=0;
+    virtual void deleteStaticText(int handle)=0;
+
+    // 別スレッドから文字を追加するための builder を作ります。これ自体はどのスレッドから呼んでも構いません
+    // builder に追加された文字は flush() で回収され、同じ layer の addText() の分の後ろに builder を作った順で描画されます
+    // レイアウトキャッシュと静的テキストは builder からは使えません
+    virtual glIFontBuilder* createBuilder()=0;
+
+    // CreateSoftwareSpriteFont() で作った renderer の描画先。RGBA8 で上の行から順に width*height 個並んでいて、flush() で描き込まれます
+    // GL で描く renderer では NULL を返し、clearCanvas()/saveCanvas() は何もしません
+    virtual const unsigned char* getCanvas(int &width, int &height) const=0;
+    virtual void clearCanvas(float r, float g, float b, float a)=0;
+    virtual bool saveCanvas(const char *path) const=0;  // 形式は拡張子で判断します (png, bmp, tga)
+
+    // 直近の flush() の統計を新しい順に最大 max_count 個 out に書き、書いた数を返します。遡れるのは 64 回分までです
+    virtual size_t getFlushStats(glIFR_FlushStats *out, size_t max_count) const=0;
+
     virtual void flush()=0;
 };
 
-glIFR_InterModule glIFontRenderer* CreateGLSpriteFont(const char *path_to_sff, const char *path_to_image);
+// glIFontRenderer::createBuilder() で作ります。1 つの builder は同時に 1 つのスレッドからのみ使ってください
+// 色/サイズ等の設定は builder 毎に独立しています。画面の設定は renderer の setScreen() に従います
+class glIFontBuilder
+{
+protected:
+    virtual ~glIFontBuilder() {}
+public:
+    virtual void release()=0;   // 作った renderer より先に release() してください
+    virtual void setColor(float r, float g, float b, float a)=0;
+    virtual void setSize(float size)=0;
+    virtual void setSpacing(float space)=0;
+    virtual void setMonospace(bool v)=0;
+    virtual void setClipRect(float left, float top, float right, float bottom)=0;
+    virtual void clearClipRect()=0;
+    virtual void setLayer(int layer)=0;
+    virtual void setOutline(float width, float r, float g, float b, float a)=0;
+    virtual void setShadow(float x, float y, float r, float g, float b, float a)=0;
+    virtual void addText(float x, float y, const char *text, size_t len=0)=0;
+    virtual void addText(float x, float y, const wchar_t *text, size_t len=0)=0;
+};
+
+// 複数のフォントの文字を 1 つのストリームにまとめて描くもの。CreateGLSpriteFontBatch() で作ります
+// createFont() で作った renderer の flush() は描かずにバッチに積むだけで、バッチの flush() で layer 順に描きます
+// 同じ layer の中は画面の行列やフォントが違っても積まれた順に重なります (行列が変わる所で draw call が分かれます)
+// 全フォントのシートを 1 つのテクスチャにまとめるので、画面の行列が同じならフォントが混ざっても draw call は 1 回 (16384 文字毎) です
+class glIFR_InterModule glIFontBatch
+{
+protected:
+    virtual ~glIFontBatch() {}
+public:
+    virtual void release()=0;   // 作った renderer を全て release() してから
+    // renderer の使い方は CreateGLSpriteFont() で作ったものと同じです。getFlushStats() は積んだ文字数のみ
+    virtual glIFontRenderer* createFont(const char *path_to_sff, const char *path_to_image)=0;
+    virtual size_t getFlushStats(glIFR_FlushStats *out, size_t max_count) const=0;  // 描画の統計。glIFontRenderer::getFlushStats() と同じ形式
+    virtual void flush()=0;
+};
+
+// CreateGLSpriteFont() の flags
+enum glIFR_CreateFlags
+{
+    glIFR_Instanced = 1<<0, // 1 文字 1 インスタンスで描画します。GL_QUADS を使わないので core profile でも動きます
+    glIFR_GPUTimer  = 1<<1, // GL_TIME_ELAPSED で flush() の GPU 時間を計り、glIFR_FlushStats::gpu_ms に入れます
+};
+
+// 同じ .sff と画像から作った renderer は、グリフ情報とテクスチャ、シェーダを共有します (最後の 1 つを release() した時に解放)
+// 共有するので、renderer は全て同じ context (か共有している context) で使ってください
+// .sff が複数のシートを持つ場合は path_to_image に %d を入れると、シート番号に置き換えて全シートを読み込みます (font_%d.png ならシート 0 は font_0.png)
+// 全シートは 1 つの GL_TEXTURE_2D_ARRAY にまとめるので、どのシートの文字が混ざっても draw call は増えません。%d がなければシート 0 だけです
+glIFR_InterModule glIFontRenderer* CreateGLSpriteFont(const char *path_to_sff, const char *path_to_image, int flags=0);
+
+// 読み込みを別スレッドで行い、すぐに返ります。テクスチャの転送とシェーダのコンパイルは読み込みが終わった後の最初の flush() で行い、そこで glIFR_Ready になります
+// それまでに追加された文字や静的テキスト、builder の文字は捨てずに貯めておき、その flush() で描きます。失敗した時は glIFR_LoadFailed になります
+// 読み込み中に setScreen() した場合も、文字はそれぞれ追加した時点のスクリーンで描きます (静的テキストは最後のスクリーンで描きます)
+glIFR_InterModule glIFontRenderer* CreateGLSpriteFontAsync(const char *path_to_sff, const char *path_to_image, int flags=0);
+
+// flags は CreateGLSpriteFont() と同じで、バッチで作る renderer 全てに適用されます
+glIFR_InterModule glIFontBatch* CreateGLSpriteFontBatch(int flags=0);
+
+// GL を使わず CPU で width x height の画像に描く renderer を作ります。GL context がなくても使えます
+// 画面は setScreen(0, width, height, 0) の状態で始まります。静的テキスト、builder、レイアウトキャッシュもそのまま使えます
+glIFR_InterModule glIFontRenderer* CreateSoftwareSpriteFont(const char *path_to_sff, const char *path_to_image, int width, int height);
+
+// 何も描かない renderer を作ります。GL context なしで文字の配置までを動かせるので、計測やツールでの利用向け
+glIFR_InterModule glIFontRenderer* CreateNullSpriteFont(const char *path_to_sff, const char *path_to_image);
 
 #endif // __glSpriteFont_h__
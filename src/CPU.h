@@ -0,0 +1,54 @@
+﻿#ifndef __ist_CPU_h__
+#define __ist_CPU_h__
+
+#ifdef _MSC_VER
+#   include <intrin.h>
+#elif defined(__i386__) || defined(__x86_64__)
+#   include <cpuid.h>
+#endif
+
+// HasCPUFeature(CPU_SSSE3) で分岐した先の、SSSE3 の命令を使う関数に付けます
+// gcc/clang はコンパイルオプションで有効にしていない命令を関数単位で許可する必要があります。MSVC は不要
+#if !defined(_MSC_VER) && (defined(__i386__) || defined(__x86_64__)) && !defined(__SSSE3__)
+#   define istTargetSSSE3 __attribute__((target("ssse3")))
+#else
+#   define istTargetSSSE3
+#endif
+
+namespace ist {
+
+    enum CPUFeature
+    {
+        CPU_SSE2    = 1<<0,
+        CPU_SSSE3   = 1<<1,
+        CPU_SSE41   = 1<<2,
+    };
+
+    inline uint32 DetectCPUFeatures()
+    {
+        uint32 r = 0;
+        int info[4] = {0, 0, 0, 0};
+#if defined(_MSC_VER)
+        __cpuid(info, 1);
+#elif defined(__i386__) || defined(__x86_64__)
+        unsigned int a, b, c, d;
+        if(__get_cpuid(1, &a, &b, &c, &d)) { info[0]=a; info[1]=b; info[2]=c; info[3]=d; }
+#endif
+        if(info[3] & (1<<26)) { r|=CPU_SSE2; }
+        if(info[2] & (1<< 9)) { r|=CPU_SSSE3; }
+        if(info[2] & (1<<19)) { r|=CPU_SSE41; }
+        return r;
+    }
+
+    /// 実行中の CPU が対応している CPUFeature の組み合わせ。初回呼び出し時に調べて覚えておきます
+    inline uint32 GetCPUFeatures()
+    {
+        static const uint32 s_features = DetectCPUFeatures();
+        return s_features;
+    }
+
+    inline bool HasCPUFeature(CPUFeature f) { return (GetCPUFeatures() & f)!=0; }
+
+} // namespace ist
+
+#endif // __ist_CPU_h__
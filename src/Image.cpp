@@ -1,5 +1,9 @@
 ﻿#include "stdafx.h"
 #include "Image.h"
+#include "CPU.h"
+#ifdef __ist_with_SSE__
+#include <tmmintrin.h>
+#endif // __ist_with_SSE__
 #ifdef __ist_with_gli__
 #include "gli/gli.hpp"
 #include "gli/gtx/loader.hpp"
@@ -116,6 +120,35 @@ bool Image::load(const char *path, const IOConfig &conf)
     return load(f, c);
 }
 
+// 読み込んだ画像から ch のチャンネルを R8U で取り出します。alpha のない画像の Channel_Alpha は 255 で埋める
+// float は ConvertF32ToU8() で 0..255 にし、符号付き 8bit は負の値を 0 にして 0..127 を 0..255 に広げます。DXT は展開しないので false
+static bool ExtractChannelU8(const Image &src, Image::Channel ch, Image &dst)
+{
+    const ImageFormat fmt = src.getFormat();
+    if(fmt==IF_Unknown || fmt>=IF_RGBA_DXT1) { return false; }
+    const bool has_alpha = fmt==IF_RGBA8U || fmt==IF_RGBA8I || fmt==IF_RGBA32F;
+    if(ch==Image::Channel_Alpha && !has_alpha) {
+        dst.resize<R_8U>(src.width(), src.height());
+        if(dst.size()>0) { ::memset(dst.data(), 0xff, dst.size()); }
+        return true;
+    }
+
+    Image tmp;
+    if(ch!=Image::Channel_Red && has_alpha) { ExtractAlpha(src, tmp); }
+    else                                     { ExtractRed(src, tmp); }
+    switch(tmp.getFormat()) {
+    case IF_R8U:
+        dst.swap(tmp);
+        return true;
+    case IF_R32F:
+        return ConvertToU8(tmp, dst);
+    case IF_R8I:
+        TExtract<R_8I, R_8U>(tmp, dst, [](const R_8I &v){ return R_8U(v.r<=0 ? 0 : uint8((int32(v.r)*255+63)/127)); });
+        return true;
+    }
+    return false;
+}
+
 bool Image::load(IBinaryStream &f, const IOConfig &conf)
 {
     clear();
@@ -124,16 +157,27 @@ bool Image::load(IBinaryStream &f, const IOConfig &conf)
     if(ft==FileType_Auto) {
         ft = GetFileTypeByFileHeader(f);
     }
+    bool r = false;
     switch(ft)
     {
-    case FileType_BMP: return loadBMP(f, conf);
-    case FileType_TGA: return loadTGA(f, conf);
-    case FileType_PNG: return loadPNG(f, conf);
-    case FileType_JPG: return loadJPG(f, conf);
-    case FileType_DDS: return loadDDS(f, conf);
+    case FileType_BMP: r = loadBMP(f, conf); break;
+    case FileType_TGA: r = loadTGA(f, conf); break;
+    case FileType_PNG: r = loadPNG(f, conf); break;
+    case FileType_JPG: r = loadJPG(f, conf); break;
+    case FileType_DDS: r = loadDDS(f, conf); break;
+    default:
+        istPrint("認識できないフォーマットが指定されました。\n");
+        return false;
     }
-    istPrint("認識できないフォーマットが指定されました。\n");
-    return false;
+
+    // チャンネル指定を直接扱えない形式はここで取り出す。PNG は loadPNG() が R8U で読み込み済み
+    const Channel ch = conf.getChannel();
+    if(r && ch!=Channel_RGBA && ft!=FileType_PNG) {
+        Image tmp;
+        if(!ExtractChannelU8(*this, ch, tmp)) { return false; }
+        swap(tmp);
+    }
+    return r;
 }
 
 
@@ -168,11 +212,160 @@ bool Image::save(IBinaryStream &f, const IOConfig &conf) const
 
 
 
-static RGBA_8U Read1Pixel(IBinaryStream &bf)
+#ifdef __ist_with_SSE__
+// num_channels は 3 か 4。16 pixel 単位で処理できた pixel 数を返します
+// 読み込んだ 16 byte 毎に、その中にある目的の byte を出力の位置に pshufb で移して重ねる
+static istTargetSSSE3 size_t ExtractChannel8SSSE3(const uint8 *src, uint8 *dst, size_t num_pixels, uint32 num_channels, uint32 channel)
+{
+    __m128i masks[4];
+    for(uint32 k=0; k<num_channels; ++k) {
+        int8 m[16];
+        for(int32 j=0; j<16; ++j) {
+            const int32 pos = j*int32(num_channels) + int32(channel) - int32(k*16);
+            m[j] = (pos>=0 && pos<16) ? int8(pos) : int8(-128);
+        }
+        masks[k] = _mm_loadu_si128((const __m128i*)m);
+    }
+    size_t i = 0;
+    for(; i+16<=num_pixels; i+=16) {
+        const uint8 *s = src + i*num_channels;
+        __m128i r = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)s), masks[0]);
+        for(uint32 k=1; k<num_channels; ++k) {
+            r = _mm_or_si128(r, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(s+k*16)), masks[k]));
+        }
+        _mm_storeu_si128((__m128i*)(dst+i), r);
+    }
+    return i;
+}
+#endif // __ist_with_SSE__
+
+void ExtractChannel8(const void *src_, void *dst_, size_t num_pixels, uint32 num_channels, uint32 channel)
+{
+    const uint8 *src = (const uint8*)src_;
+    uint8 *dst = (uint8*)dst_;
+    if(num_channels==1) {
+        ::memcpy(dst, src, num_pixels);
+        return;
+    }
+
+    size_t i = 0;
+#ifdef __ist_with_SSE__
+    static const bool s_sse2 = HasCPUFeature(CPU_SSE2);
+    static const bool s_ssse3 = HasCPUFeature(CPU_SSSE3);
+    if(s_ssse3 && (num_channels==3 || num_channels==4)) {
+        i = ExtractChannel8SSSE3(src, dst, num_pixels, num_channels, channel);
+    }
+    else if(s_sse2 && num_channels==4) {
+        // 32bit 毎にずらして下位 8bit を残し、飽和 pack で詰める
+        const __m128i shift = _mm_cvtsi32_si128(int(channel*8));
+        const __m128i mask = _mm_set1_epi32(0xff);
+        for(; i+16<=num_pixels; i+=16) {
+            const __m128i *s = (const __m128i*)(src + i*4);
+            const __m128i v0 = _mm_and_si128(_mm_srl_epi32(_mm_loadu_si128(s+0), shift), mask);
+            const __m128i v1 = _mm_and_si128(_mm_srl_epi32(_mm_loadu_si128(s+1), shift), mask);
+            const __m128i v2 = _mm_and_si128(_mm_srl_epi32(_mm_loadu_si128(s+2), shift), mask);
+            const __m128i v3 = _mm_and_si128(_mm_srl_epi32(_mm_loadu_si128(s+3), shift), mask);
+            _mm_storeu_si128((__m128i*)(dst+i), _mm_packus_epi16(_mm_packs_epi32(v0, v1), _mm_packs_epi32(v2, v3)));
+        }
+    }
+    if(s_sse2 && num_channels==2) {
+        const __m128i shift = _mm_cvtsi32_si128(int(channel*8));
+        const __m128i mask = _mm_set1_epi16(0xff);
+        for(; i+16<=num_pixels; i+=16) {
+            const __m128i *s = (const __m128i*)(src + i*2);
+            const __m128i v0 = _mm_and_si128(_mm_srl_epi16(_mm_loadu_si128(s+0), shift), mask);
+            const __m128i v1 = _mm_and_si128(_mm_srl_epi16(_mm_loadu_si128(s+1), shift), mask);
+            _mm_storeu_si128((__m128i*)(dst+i), _mm_packus_epi16(v0, v1));
+        }
+    }
+#endif // __ist_with_SSE__
+    for(; i<num_pixels; ++i) {
+        dst[i] = src[i*num_channels+channel];
+    }
+}
+
+void SwapRB8(const void *src_, void *dst_, size_t num_pixels)
+{
+    const uint8 *src = (const uint8*)src_;
+    uint8 *dst = (uint8*)dst_;
+    size_t i = 0;
+#ifdef __ist_with_SSE__
+    static const bool s_sse2 = HasCPUFeature(CPU_SSE2);
+    if(s_sse2) {
+        const __m128i mask_ga = _mm_set1_epi32(0xff00ff00);
+        const __m128i mask_rb = _mm_set1_epi32(0x00ff00ff);
+        for(; i+4<=num_pixels; i+=4) {
+            const __m128i v = _mm_loadu_si128((const __m128i*)(src+i*4));
+            const __m128i rb = _mm_and_si128(v, mask_rb);
+            const __m128i br = _mm_or_si128(_mm_srli_epi32(rb, 16), _mm_slli_epi32(rb, 16));
+            _mm_storeu_si128((__m128i*)(dst+i*4), _mm_or_si128(_mm_and_si128(v, mask_ga), br));
+        }
+    }
+#endif // __ist_with_SSE__
+    for(; i<num_pixels; ++i) {
+        const uint8 b = src[i*4+0], g = src[i*4+1], r = src[i*4+2], a = src[i*4+3];
+        dst[i*4+0]=r; dst[i*4+1]=g; dst[i*4+2]=b; dst[i*4+3]=a;
+    }
+}
+
+void ConvertU8ToF32(const uint8 *src, float32 *dst, size_t num)
+{
+    size_t i = 0;
+#ifdef __ist_with_SSE__
+    static const bool s_sse2 = HasCPUFeature(CPU_SSE2);
+    if(s_sse2) {
+        // 割り算のまま計算して、スカラー版と同じ値にしておく
+        const __m128i zero = _mm_setzero_si128();
+        const __m128 c255 = _mm_set1_ps(255.0f);
+        for(; i+16<=num; i+=16) {
+            const __m128i v = _mm_loadu_si128((const __m128i*)(src+i));
+            const __m128i lo = _mm_unpacklo_epi8(v, zero);
+            const __m128i hi = _mm_unpackhi_epi8(v, zero);
+            _mm_storeu_ps(dst+i+ 0, _mm_div_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(lo, zero)), c255));
+            _mm_storeu_ps(dst+i+ 4, _mm_div_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(lo, zero)), c255));
+            _mm_storeu_ps(dst+i+ 8, _mm_div_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(hi, zero)), c255));
+            _mm_storeu_ps(dst+i+12, _mm_div_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(hi, zero)), c255));
+        }
+    }
+#endif // __ist_with_SSE__
+    for(; i<num; ++i) {
+        dst[i] = float32(src[i])/255.0f;
+    }
+}
+
+void ConvertF32ToU8(const float32 *src, uint8 *dst, size_t num)
+{
+    size_t i = 0;
+#ifdef __ist_with_SSE__
+    static const bool s_sse2 = HasCPUFeature(CPU_SSE2);
+    if(s_sse2) {
+        // 0..255 に収めてから切り捨てで整数にする。cvttps は範囲外 (1e10 や +INF) を 0x80000000 にするので先に収めておく
+        // maxps は NaN の時に 2 番目の引数を返すので、NaN もスカラー版と同じく 0 になります
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 c255 = _mm_set1_ps(255.0f);
+        for(; i+16<=num; i+=16) {
+            const __m128i v0 = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(src+i+ 0), c255), zero), c255));
+            const __m128i v1 = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(src+i+ 4), c255), zero), c255));
+            const __m128i v2 = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(src+i+ 8), c255), zero), c255));
+            const __m128i v3 = _mm_cvttps_epi32(_mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_loadu_ps(src+i+12), c255), zero), c255));
+            _mm_storeu_si128((__m128i*)(dst+i), _mm_packus_epi16(_mm_packs_epi32(v0, v1), _mm_packs_epi32(v2, v3)));
+        }
+    }
+#endif // __ist_with_SSE__
+    for(; i<num; ++i) {
+        const float32 v = src[i]*255.0f;
+        dst[i] = !(v>0.0f) ? 0 : (v>=255.0f ? 255 : uint8(v));
+    }
+}
+
+// 上下反転。ファイル上で下の行から並んでいる形式用
+static void FlipRows(uint8 *pixels, size_t row_bytes, size_t num_rows)
 {
-    RGBA_8U t;
-    bf >> t.b >> t.g >> t.r >> t.a;
-    return t;
+    for(size_t i=0; i<num_rows/2; ++i) {
+        uint8 *a = pixels + row_bytes*i;
+        uint8 *b = pixels + row_bytes*(num_rows-1-i);
+        stl::swap_ranges(a, a+row_bytes, b);
+    }
 }
 
 
@@ -208,27 +401,40 @@ bool Image::loadBMP(IBinaryStream &bf, const IOConfig &conf)
         istPrint(L"bmp は現在 24bit か 32bit しか対応していません。\n");
         return false;
     }
+    // 情報ヘッダが大きい (V4/V5 等) 場合は画素データまで読み飛ばす
+    const int32 read_size = 14+40;
+    if(head.offset>read_size) { bf.setReadPos(head.offset-read_size, IBinaryStream::Seek_Current); }
+
+    // height が負なら上の行から並んでいる
+    const bool top_down = infohead.height<0;
+    const uint32 w = infohead.width;
+    const uint32 h = top_down ? -infohead.height : infohead.height;
+    resize<RGBA_8U>(w, h);
+    if(w==0 || h==0) { return true; }
+    uint8 *pixels = (uint8*)data();
+    const size_t row_bytes = w*4;
 
-    resize<RGBA_8U>(infohead.width, infohead.height);
-
-    if(infohead.bits==24) {
-        for(int32 yi=(int32)height()-1; yi>=0; --yi) {
-            for(int32 xi=0; xi<(int32)width(); ++xi) {
-                RGBA_8U& c = get<RGBA_8U>(yi, xi);
-                bf >> c.b >> c.g >> c.r;
-                c.a = 255;
-            }
-        }
+    if(infohead.bits==32) {
+        // 32bit は行の詰め物がないので、まとめて読んでからメモリ上で並べ替える
+        if(bf.read(pixels, row_bytes*h)!=row_bytes*h) { return false; }
     }
-    else if(infohead.bits==32) {
-        for(int32 yi=(int32)height()-1; yi>=0; --yi) {
-            for(int32 xi=0; xi<(int32)width(); ++xi) {
-                RGBA_8U& c = get<RGBA_8U>(yi, xi);
-                bf >> c.b >> c.g >> c.r >> c.a;
+    else {
+        // 24bit の行は 4 byte 境界に揃えられている
+        const size_t stride = (w*3+3) & ~3;
+        stl::vector<uint8> row(stride);
+        for(uint32 yi=0; yi<h; ++yi) {
+            if(bf.read(&row[0], stride)!=stride) { return false; }
+            uint8 *dst = pixels + row_bytes*yi;
+            for(uint32 xi=0; xi<w; ++xi) {
+                dst[xi*4+0] = row[xi*3+0];
+                dst[xi*4+1] = row[xi*3+1];
+                dst[xi*4+2] = row[xi*3+2];
+                dst[xi*4+3] = 255;
             }
         }
     }
-
+    if(!top_down) { FlipRows(pixels, row_bytes, h); }
+    SwapRB8(pixels, pixels, w*h);
     return true;
 }
 
@@ -238,7 +444,9 @@ bool Image::saveBMP(IBinaryStream &bf, const IOConfig &conf) const
     BMPHEAD head;
     BMPINFOHEAD infohead;
 
-    head.file_size = sizeof(BMPHEAD)+sizeof(BMPINFOHEAD)+width()*height()*3;
+    // 24bit の行は 4 byte 境界に揃える
+    const size_t stride = (width()*3+3) & ~3;
+    head.file_size = 14+40+stride*height();
     infohead.width = width();
     infohead.height = height();
 
@@ -260,11 +468,16 @@ bool Image::saveBMP(IBinaryStream &bf, const IOConfig &conf) const
         << infohead.pallete_num
         << infohead.important_pallete_num;
 
+    // 1 行ずつメモリ上で BGR に並べ替えて書く
+    stl::vector<uint8> row(stride, 0);
     for(int32 yi=(int32)height()-1; yi>=0; --yi) {
-        for(int32 xi=0; xi<(int32)width(); ++xi) {
-            const RGBA_8U& c = get<RGBA_8U>(yi, xi);
-            bf << c.b << c.g << c.r;
+        const uint8 *src = (const uint8*)&get<RGBA_8U>(yi, 0);
+        for(size_t xi=0; xi<width(); ++xi) {
+            row[xi*3+0] = src[xi*4+2];
+            row[xi*3+1] = src[xi*4+1];
+            row[xi*3+2] = src[xi*4+0];
         }
+        bf.write(&row[0], stride);
     }
     return true;
 }
@@ -294,121 +507,89 @@ bool Image::loadTGA(IBinaryStream &bf, const IOConfig &conf)
         istPrint("32bit データしか対応していません。\n");
         return false;
     }
+    if(head.image_type!=2 && head.image_type!=10)
+    {
+        istPrint("非圧縮か RLE のフルカラーしか対応していません。\n");
+        return false;
+    }
+    // ID フィールドは読み飛ばす
+    if(head.No_ID>0) { bf.setReadPos(head.No_ID, IBinaryStream::Seek_Current); }
 
     resize<RGBA_8U>(head.width, head.height);
+    if(width()==0 || height()==0) { return true; }
+    uint8 *pixels = (uint8*)data();
+    const size_t row_bytes = width()*4;
+    const size_t total = row_bytes*height();
 
-    for(int32 yi=(int32)height()-1; yi>=0; --yi) {
-        if(head.image_type==2) {
-            for(int32 xi=0; xi<(int32)width(); xi++) {
-                get<RGBA_8U>(yi, xi) = Read1Pixel(bf);
+    if(head.image_type==2) {
+        if(bf.read(pixels, total)!=total) { return false; }
+    }
+    else if(head.image_type==10) {
+        // 圧縮後のサイズはヘッダにないので、残りを全部読んでからメモリ上で展開する
+        // パケットが行をまたいでいても構わないよう、画像全体を 1 つの列として展開します
+        const uint64 pos = bf.getReadPos();
+        bf.setReadPos(0, IBinaryStream::Seek_End);
+        const size_t remain = size_t(bf.getReadPos()-pos);
+        bf.setReadPos(pos);
+        stl::vector<uint8> comp(remain);
+        if(remain==0 || bf.read(&comp[0], remain)!=remain) { return false; }
+
+        const uint8 *src = &comp[0];
+        const uint8 *src_end = src+remain;
+        uint8 *dst = pixels;
+        uint8 *dst_end = pixels+total;
+        while(dst<dst_end && src<src_end) {
+            const uint8 packet = *src++;
+            const size_t n = stl::min<size_t>((packet&0x7f)+1, (dst_end-dst)/4);
+            if(packet<0x80) {
+                if(size_t(src_end-src)<n*4) { return false; }
+                ::memcpy(dst, src, n*4);
+                src += n*4;
             }
-        }
-        else if(head.image_type==10) {
-            uint32 loaded = 0;
-            while(loaded<width()) {
-                uint8 dist = 0;
-                bf >> dist;
-                if( dist<0x80) {
-                    for(int32 xi=0; xi<dist+1; ++xi, ++loaded) {
-                        get<RGBA_8U>(yi, loaded) = Read1Pixel(bf);
-                    }
-                }
-                else {
-                    RGBA_8U t = Read1Pixel(bf);
-                    for(int32 xi=0x80; xi<dist+1; ++xi, ++loaded) {
-                        get<RGBA_8U>(yi, loaded) = t;
-                    }
-                }
+            else {
+                if(src_end-src<4) { return false; }
+                uint32 pixel;
+                ::memcpy(&pixel, src, 4);
+                src += 4;
+                for(size_t i=0; i<n; ++i) { ::memcpy(dst+i*4, &pixel, 4); }
             }
+            dst += n*4;
         }
+        if(dst<dst_end) { return false; }
     }
-
+    // IDesc_Type の bit5 が立っていれば上の行から並んでいる
+    if((head.IDesc_Type & 0x20)==0) { FlipRows(pixels, row_bytes, height()); }
+    SwapRB8(pixels, pixels, width()*height());
     return true;
 }
 
 
-class TGACompress
-{
-public:
-    TGACompress() {}
-
-    const stl::vector<uint8>& getCompressedData() const { return m_comp_pixel; }
-
-    void compress(const RGBA_8U *start, int32 width)
-    {
-        stl::vector<RGBA_8U> same, diff;
-
-        for(int32 i=0; i!=width; ++i, ++start)
-        {
-            const RGBA_8U *ip=start; ++ip;
-            RGBA_8U dist=*start;
-
-            if( i+1!=width && dist==*ip && same.size()<0x79 )
-            {
-                same.push_back(dist);
-                if(diff.size()!=0)
-                {
-                    writeDifferentData(diff);
-                }
-            }
-            else
-            {
-                if(same.size()>0x00)
-                {
-                    writeSameData(same);
-                }
-                else
-                {
-                    diff.push_back(dist);
-                    if(diff.size()==0x79 )
-                    {
-                        writeDifferentData(diff);
-                    }
-                }
-            }
-        }
-
-        if(same.size()!=0x00)
-        {
-            writeSameData(same);
-        }
-        else if(diff.size()!=0)
-        {
-            writeDifferentData(diff);
-        }
-    }
-
-private:
-    void writeSameData(stl::vector<RGBA_8U> &temp_pixel)
-    {
-        m_comp_pixel.push_back( temp_pixel.size()+0x80 );
-
-        m_comp_pixel.push_back( temp_pixel[0].b );
-        m_comp_pixel.push_back( temp_pixel[0].g );
-        m_comp_pixel.push_back( temp_pixel[0].r );
-        m_comp_pixel.push_back( temp_pixel[0].a );
-
-        temp_pixel.clear();
-    }
+// 1 パケットの最大 pixel 数。形式上は 128 まで表せますが、以前の実装と同じ出力になるようにその値で区切ります
+static const size_t TGAMaxRun = 122;    // 繰り返しパケット
+static const size_t TGAMaxRaw = 121;    // 非圧縮パケット
 
-    void writeDifferentData(stl::vector<RGBA_8U> &temp_pixel)
-    {
-        m_comp_pixel.push_back( temp_pixel.size()-1 );
-
-        for(int32 d=0; d<(int32)temp_pixel.size(); d++)
-        {
-            m_comp_pixel.push_back( temp_pixel[d].b );
-            m_comp_pixel.push_back( temp_pixel[d].g );
-            m_comp_pixel.push_back( temp_pixel[d].r );
-            m_comp_pixel.push_back( temp_pixel[d].a );
+// 1 行分を RLE で圧縮して dst に追加します。src は BGRA
+// 同じ色が 2 つ以上続けば繰り返しパケット、それ以外は非圧縮パケットにまとめます
+static void CompressTGARow(const uint8 *src, size_t width, stl::vector<uint8> &dst)
+{
+    size_t i = 0;
+    while(i<width) {
+        size_t run = 1;
+        while(i+run<width && run<TGAMaxRun && ::memcmp(src+i*4, src+(i+run)*4, 4)==0) { ++run; }
+        if(run>=2) {
+            dst.push_back(uint8(0x80 | (run-1)));
+            dst.insert(dst.end(), src+i*4, src+i*4+4);
+            i += run;
+            continue;
         }
-
-        temp_pixel.clear();
+        // 次に同じ色が続く所の手前まで
+        size_t n = 1;
+        while(i+n<width && n<TGAMaxRaw && (i+n+1>=width || ::memcmp(src+(i+n)*4, src+(i+n+1)*4, 4)!=0)) { ++n; }
+        dst.push_back(uint8(n-1));
+        dst.insert(dst.end(), src+i*4, src+(i+n)*4);
+        i += n;
     }
-
-private:
-    stl::vector<uint8> m_comp_pixel;
-};
+}
 
 bool Image::saveTGA(IBinaryStream &bf, const Image::IOConfig &conf) const
 {
@@ -428,14 +609,18 @@ bool Image::saveTGA(IBinaryStream &bf, const Image::IOConfig &conf) const
         << head.pixel
         << head.IDesc_Type;
 
+    if(width()==0 || height()==0) { return true; }
     {
-        TGACompress comp;
+        // 下の行から BGRA に並べ替えて圧縮し、最後にまとめて書く
+        stl::vector<uint8> row(width()*4);
+        stl::vector<uint8> comp;
+        comp.reserve(width()*height()*4 + width()*height()/TGAMaxRaw + height());
         for(int32 yi=(int32)height()-1; yi>=0; --yi)
         {
-            comp.compress(&get<RGBA_8U>(yi, 0), width());
+            SwapRB8((const uint8*)&get<RGBA_8U>(yi, 0), &row[0], width());
+            CompressTGARow(&row[0], width(), comp);
         }
-        const stl::vector<uint8>& data = comp.getCompressedData();
-        bf.write(&data[0], data.size());
+        bf.write(&comp[0], comp.size());
     }
 
     return true;
@@ -492,8 +677,6 @@ bool Image::loadPNG(IBinaryStream &f, const IOConfig &conf)
     ::png_read_info(png_ptr, info_ptr);
     ::png_get_IHDR(png_ptr, info_ptr, &w, &h, &bit_depth, &color_type, &interlace_type, NULL, NULL);
 
-    resize<RGBA_8U>(w, h);
-
     ::png_set_strip_16(png_ptr);
     ::png_set_packing(png_ptr);
     if(color_type==PNG_COLOR_TYPE_PALETTE)
@@ -508,37 +691,67 @@ bool Image::loadPNG(IBinaryStream &f, const IOConfig &conf)
     {
         ::png_set_tRNS_to_alpha(png_ptr);
     }
+    const Channel ch = conf.getChannel();
+    if(ch==Channel_RGBA) {
+        // グレースケールも含めて libpng に RGBA8 にしてもらい、直接書き込む
+        if(color_type==PNG_COLOR_TYPE_GRAY || color_type==PNG_COLOR_TYPE_GRAY_ALPHA) {
+            ::png_set_gray_to_rgb(png_ptr);
+        }
+        ::png_set_filler(png_ptr, 0xff, PNG_FILLER_AFTER);
+    }
+    ::png_set_interlace_handling(png_ptr);
     ::png_read_update_info(png_ptr, info_ptr);
 
 
     // 読み込み
-    stl::vector<png_bytep> row_pointers(height());
-    for(int32 row=0; row<(int32)height(); ++row) {
-        row_pointers[row] = (png_bytep)png_malloc(png_ptr, png_get_rowbytes(png_ptr, info_ptr));
-    }
-    png_read_image(png_ptr, &row_pointers[0]);
-
-    for(int32 yi=0; yi<(int32)height(); ++yi) {
-        for(int32 xi=0; xi<(int32)width(); ++xi) {
-            RGBA_8U& c = get<RGBA_8U>(yi, xi);
-            if(color_type==PNG_COLOR_TYPE_RGB_ALPHA) {
-                c.r = row_pointers[yi][xi*4+0];
-                c.g = row_pointers[yi][xi*4+1];
-                c.b = row_pointers[yi][xi*4+2];
-                c.a = row_pointers[yi][xi*4+3];
+    if(ch==Channel_RGBA) {
+        resize<RGBA_8U>(w, h);
+        stl::vector<png_bytep> row_pointers(height());
+        for(uint32 row=0; row<h; ++row) {
+            row_pointers[row] = (png_bytep)&get<RGBA_8U>(row, 0);
+        }
+        ::png_read_image(png_ptr, &row_pointers[0]);
+    }
+    else {
+        // 指定のチャンネルだけ R8U に書き込む。src_ch<0 ならそのチャンネルがないので 255 で埋める
+        resize<R_8U>(w, h);
+        const size_t num_channels = ::png_get_channels(png_ptr, info_ptr);
+        const bool has_alpha = num_channels==2 || num_channels==4;
+        int32 src_ch = 0;
+        if(ch==Channel_Alpha || (ch==Channel_AlphaOrRed && has_alpha)) { src_ch = has_alpha ? int32(num_channels-1) : -1; }
+
+        if(num_channels==1 && src_ch==0) {
+            // そのまま書き込める
+            stl::vector<png_bytep> row_pointers(height());
+            for(uint32 row=0; row<h; ++row) {
+                row_pointers[row] = (png_bytep)&get<R_8U>(row, 0);
+            }
+            ::png_read_image(png_ptr, &row_pointers[0]);
+        }
+        else {
+            // インターレースは全パスを重ねる必要があるので画像全体、そうでなければ 1 行分のバッファで読む
+            const size_t row_bytes = ::png_get_rowbytes(png_ptr, info_ptr);
+            const bool interlaced = interlace_type!=PNG_INTERLACE_NONE;
+            stl::vector<png_byte> buf(row_bytes * (interlaced ? h : 1));
+            if(interlaced) {
+                stl::vector<png_bytep> row_pointers(height());
+                for(uint32 row=0; row<h; ++row) { row_pointers[row] = &buf[row_bytes*row]; }
+                ::png_read_image(png_ptr, &row_pointers[0]);
             }
-            else if(color_type==PNG_COLOR_TYPE_RGB) {
-                c.r = row_pointers[yi][xi*3+0];
-                c.g = row_pointers[yi][xi*3+1];
-                c.b = row_pointers[yi][xi*3+2];
-                c.a = 255;
+            uint8 *dst = (uint8*)data();
+            for(uint32 row=0; row<h; ++row, dst+=w) {
+                const png_byte *src = &buf[interlaced ? row_bytes*row : 0];
+                if(!interlaced) { ::png_read_row(png_ptr, &buf[0], NULL); }
+                if(src_ch<0) {
+                    ::memset(dst, 0xff, w);
+                    continue;
+                }
+                src += src_ch;
+                for(uint32 xi=0; xi<w; ++xi, src+=num_channels) { dst[xi] = *src; }
             }
         }
     }
-    for(int32 row=0; row<(int32)height(); ++row) {
-        png_free(png_ptr, row_pointers[row]);
-    }
-    png_read_end(png_ptr, info_ptr);
+    ::png_read_end(png_ptr, info_ptr);
 
 
     png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
@@ -128,24 +128,38 @@ public:
         FileType_Unknown,
     };
 
+    // 読み込み時に 1 チャンネルだけ取り出す指定。Channel_RGBA 以外はどの形式も R8U で読み込みます
+    // PNG はデコードしながら直接書き込むので、RGBA の画像を経由しません
+    // float の画像は ConvertF32ToU8() と同じく 0..255 に、符号付き 8bit は負の値を 0 にして変換します。DXT の画像は展開しないので読み込みに失敗します
+    enum Channel
+    {
+        Channel_RGBA,       // 取り出さない
+        Channel_Red,        // グレースケールならその値
+        Channel_Alpha,      // alpha がない画像は 255
+        Channel_AlphaOrRed, // alpha があれば alpha、なければ red
+    };
+
     class IOConfig
     {
     public:
-        IOConfig() : m_filetype(FileType_Auto), m_png_compress_level(9), m_jpg_quality(100)
+        IOConfig() : m_filetype(FileType_Auto), m_png_compress_level(9), m_jpg_quality(100), m_channel(Channel_RGBA)
         {}
 
         void setFileType(FileType v)               { m_filetype=v; }
         void setPngCompressLevel(uint8 v)       { m_png_compress_level=v; }
         void setJpgQuality(uint8 v)             { m_jpg_quality=v; }
+        void setChannel(Channel v)              { m_channel=v; }
 
         FileType getFileType() const           { return m_filetype; }
         uint8 getPngCompressLevel() const   { return m_png_compress_level; }
         uint8 getJpgQuality() const         { return m_jpg_quality; }
+        Channel getChannel() const          { return m_channel; }
 
     private:
         FileType m_filetype;
         uint8 m_png_compress_level;
         uint8 m_jpg_quality;
+        Channel m_channel;
     };
 
 public:
@@ -161,6 +175,15 @@ public:
         m_data.clear();
     }
 
+    // 画素をコピーせずに入れ替えます
+    void swap(Image &o)
+    {
+        m_data.swap(o.m_data);
+        stl::swap(m_format, o.m_format);
+        stl::swap(m_width, o.m_width);
+        stl::swap(m_height, o.m_height);
+    }
+
     template<class T> void resize(uint32 w, uint32 h)
     {
         m_width = w;
@@ -228,6 +251,16 @@ private:
 // utilities
 //
 
+// 画素の一括変換。CPU に応じて SSE2/SSSE3 を使い分けます (Image.cpp)
+// 8bit で num_channels チャンネルの画素列から channel 番目だけを取り出す
+istInterModule void ExtractChannel8(const void *src, void *dst, size_t num_pixels, uint32 num_channels, uint32 channel);
+// RGBA <-> BGRA。src==dst でも構いません
+istInterModule void SwapRB8(const void *src, void *dst, size_t num_pixels);
+// x/255。ToF32() と同じ値になります
+istInterModule void ConvertU8ToF32(const uint8 *src, float32 *dst, size_t num);
+// x*255 を切り捨て。[0,1] の範囲では ToU8() と同じ値で、範囲外は 0 か 255 に飽和します
+istInterModule void ConvertF32ToU8(const float32 *src, uint8 *dst, size_t num);
+
 template<class SrcT, class DstT, class F>
 inline void TExtract(const Image &src, Image &dst, const F &f)
 {
@@ -241,11 +274,20 @@ inline void TExtractAlpha(const Image &src, Image &dst)
     TExtract<SrcT, DstT>(src, dst, [&](const SrcT &s){ return DstT(s.a); });
 }
 
+// 8bit のフォーマット用。ExtractChannel8() で取り出します
+template<class SrcT, class DstT>
+inline void TExtractChannel8(const Image &src, Image &dst, uint32 channel)
+{
+    dst.resize<DstT>(src.width(), src.height());
+    if(dst.size()==0) { return; }
+    ExtractChannel8(src.data(), dst.data(), src.width()*src.height(), sizeof(SrcT), channel);
+}
+
 inline bool ExtractAlpha(const Image &src, Image &dst)
 {
     switch(src.getFormat()) {
-    case IF_RGBA8U:  TExtractAlpha<RGBA_8U, R_8U>(src, dst); return true;
-    case IF_RGBA8I:  TExtractAlpha<RGBA_8I, R_8I>(src, dst); return true;
+    case IF_RGBA8U:  TExtractChannel8<RGBA_8U, R_8U>(src, dst, 3); return true;
+    case IF_RGBA8I:  TExtractChannel8<RGBA_8I, R_8I>(src, dst, 3); return true;
     case IF_RGBA32F: TExtractAlpha<RGBA_32F, R_32F>(src, dst); return true;
     }
     return false;
@@ -261,14 +303,14 @@ inline void TExtractRed(const Image &src, Image &dst)
 inline bool ExtractRed(const Image &src, Image &dst)
 {
     switch(src.getFormat()) {
-    case IF_R8U:  TExtractRed<R_8U, R_8U>(src, dst); return true;
-    case IF_RG8U:  TExtractRed<RG_8U, R_8U>(src, dst); return true;
-    case IF_RGB8U:  TExtractRed<RGB_8U, R_8U>(src, dst); return true;
-    case IF_RGBA8U:  TExtractRed<RGBA_8U, R_8U>(src, dst); return true;
-    case IF_R8I:  TExtractRed<R_8I, R_8I>(src, dst); return true;
-    case IF_RG8I:  TExtractRed<RG_8I, R_8I>(src, dst); return true;
-    case IF_RGB8I:  TExtractRed<RGB_8I, R_8I>(src, dst); return true;
-    case IF_RGBA8I:  TExtractRed<RGBA_8I, R_8I>(src, dst); return true;
+    case IF_R8U:  TExtractChannel8<R_8U, R_8U>(src, dst, 0); return true;
+    case IF_RG8U:  TExtractChannel8<RG_8U, R_8U>(src, dst, 0); return true;
+    case IF_RGB8U:  TExtractChannel8<RGB_8U, R_8U>(src, dst, 0); return true;
+    case IF_RGBA8U:  TExtractChannel8<RGBA_8U, R_8U>(src, dst, 0); return true;
+    case IF_R8I:  TExtractChannel8<R_8I, R_8I>(src, dst, 0); return true;
+    case IF_RG8I:  TExtractChannel8<RG_8I, R_8I>(src, dst, 0); return true;
+    case IF_RGB8I:  TExtractChannel8<RGB_8I, R_8I>(src, dst, 0); return true;
+    case IF_RGBA8I:  TExtractChannel8<RGBA_8I, R_8I>(src, dst, 0); return true;
     case IF_R32F:  TExtractRed<R_32F, R_32F>(src, dst); return true;
     case IF_RG32F:  TExtractRed<RG_32F, R_32F>(src, dst); return true;
     case IF_RGB32F:  TExtractRed<RGB_32F, R_32F>(src, dst); return true;
@@ -277,6 +319,34 @@ inline bool ExtractRed(const Image &src, Image &dst)
     return false;
 }
 
+
+// ToF32()/ToU8() を画像全体に行います。チャンネル数はそのまま
+inline bool ConvertToF32(const Image &src, Image &dst)
+{
+    switch(src.getFormat()) {
+    case IF_R8U:    dst.resize<R_32F>(src.width(), src.height()); break;
+    case IF_RG8U:   dst.resize<RG_32F>(src.width(), src.height()); break;
+    case IF_RGB8U:  dst.resize<RGB_32F>(src.width(), src.height()); break;
+    case IF_RGBA8U: dst.resize<RGBA_32F>(src.width(), src.height()); break;
+    default: return false;
+    }
+    if(src.size()>0) { ConvertU8ToF32((const uint8*)src.data(), (float32*)dst.data(), src.size()); }
+    return true;
+}
+
+inline bool ConvertToU8(const Image &src, Image &dst)
+{
+    switch(src.getFormat()) {
+    case IF_R32F:    dst.resize<R_8U>(src.width(), src.height()); break;
+    case IF_RG32F:   dst.resize<RG_8U>(src.width(), src.height()); break;
+    case IF_RGB32F:  dst.resize<RGB_8U>(src.width(), src.height()); break;
+    case IF_RGBA32F: dst.resize<RGBA_8U>(src.width(), src.height()); break;
+    default: return false;
+    }
+    if(dst.size()>0) { ConvertF32ToU8((const float32*)src.data(), (uint8*)dst.data(), dst.size()); }
+    return true;
+}
+
 } // namespace ist
 
 #endif // __ist_GraphicsCommon_Image_h__
@@ -0,0 +1,81 @@
+﻿#ifndef __ist_MappedFile_h__
+#define __ist_MappedFile_h__
+
+#ifndef istWindows
+#   include <sys/mman.h>
+#   include <sys/stat.h>
+#   include <fcntl.h>
+#   include <unistd.h>
+#endif // istWindows
+
+namespace ist {
+
+    /// ファイルを読み込み専用でメモリにマップします
+    /// ページは触った分だけ読まれ、同じファイルをマップしている他のインスタンスやプロセスと OS のキャッシュを共有します
+    class MappedFile
+    {
+    public:
+        MappedFile() : m_data(NULL), m_size(0) {}
+        ~MappedFile() { close(); }
+
+        /// 空のファイルはマップできないので失敗扱いになります
+        bool open(const char *path)
+        {
+            close();
+#ifdef istWindows
+            HANDLE file = ::CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+            if(file==INVALID_HANDLE_VALUE) { return false; }
+            LARGE_INTEGER size;
+            HANDLE mapping = NULL;
+            if(::GetFileSizeEx(file, &size) && size.QuadPart>0) {
+                mapping = ::CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+            }
+            // view が残っていればハンドルは閉じてしまって問題ない
+            if(mapping!=NULL) {
+                m_data = (const char*)::MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+                if(m_data!=NULL) { m_size = (size_t)size.QuadPart; }
+                ::CloseHandle(mapping);
+            }
+            ::CloseHandle(file);
+#else // istWindows
+            int fd = ::open(path, O_RDONLY);
+            if(fd<0) { return false; }
+            struct stat st;
+            if(::fstat(fd, &st)==0 && st.st_size>0) {
+                void *p = ::mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+                if(p!=MAP_FAILED) {
+                    m_data = (const char*)p;
+                    m_size = (size_t)st.st_size;
+                }
+            }
+            ::close(fd);
+#endif // istWindows
+            return m_data!=NULL;
+        }
+
+        void close()
+        {
+            if(m_data==NULL) { return; }
+#ifdef istWindows
+            ::UnmapViewOfFile(m_data);
+#else // istWindows
+            ::munmap((void*)m_data, m_size);
+#endif // istWindows
+            m_data = NULL;
+            m_size = 0;
+        }
+
+        bool isOpened() const       { return m_data!=NULL; }
+        const char* data() const    { return m_data; }
+        size_t size() const         { return m_size; }
+
+    private:
+        MappedFile(const MappedFile&);
+        MappedFile& operator=(const MappedFile&);
+        const char *m_data;
+        size_t m_size;
+    };
+
+} // namespace ist
+
+#endif // __ist_MappedFile_h__
@@ -1,6 +1,10 @@
 ﻿#ifndef __ist_Math_Misc_h__
 #define __ist_Math_Misc_h__
 
+#ifndef istWindows
+#   include <time.h>
+#endif // istWindows
+
 namespace ist {
 
     /// メンバ関数ポインタとかは普通のキャストが効かないので union で強引にキャスト
@@ -33,6 +37,22 @@ namespace ist {
         }
     }
 
+    /// 単調増加する時刻 (ナノ秒)。計測用
+    inline uint64 GetTimeNS()
+    {
+#ifdef istWindows
+        static LARGE_INTEGER s_freq = {0};
+        if(s_freq.QuadPart==0) { ::QueryPerformanceFrequency(&s_freq); }
+        LARGE_INTEGER v;
+        ::QueryPerformanceCounter(&v);
+        return uint64(v.QuadPart/s_freq.QuadPart)*1000000000ULL + uint64(v.QuadPart%s_freq.QuadPart)*1000000000ULL/uint64(s_freq.QuadPart);
+#else // istWindows
+        timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return uint64(ts.tv_sec)*1000000000ULL + uint64(ts.tv_nsec);
+#endif // istWindows
+    }
+
 } // namespace ist
 
 #endif // __ist_Math_Misc_h__
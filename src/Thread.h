@@ -0,0 +1,146 @@
+﻿#ifndef __ist_Thread_h__
+#define __ist_Thread_h__
+
+#ifdef istWindows
+#   include <process.h>
+#else // istWindows
+#   include <pthread.h>
+#   include <unistd.h>
+#endif // istWindows
+
+namespace ist {
+
+    /// 再帰ロック可能な mutex。VS2010 には std::mutex がないので OS のものを薄く包んでいます
+    class Mutex
+    {
+    public:
+#ifdef istWindows
+        Mutex()         { ::InitializeCriticalSection(&m_cs); }
+        ~Mutex()        { ::DeleteCriticalSection(&m_cs); }
+        void lock()     { ::EnterCriticalSection(&m_cs); }
+        void unlock()   { ::LeaveCriticalSection(&m_cs); }
+#else // istWindows
+        Mutex()
+        {
+            pthread_mutexattr_t attr;
+            pthread_mutexattr_init(&attr);
+            pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+            pthread_mutex_init(&m_mutex, &attr);
+            pthread_mutexattr_destroy(&attr);
+        }
+        ~Mutex()        { pthread_mutex_destroy(&m_mutex); }
+        void lock()     { pthread_mutex_lock(&m_mutex); }
+        void unlock()   { pthread_mutex_unlock(&m_mutex); }
+#endif // istWindows
+
+    private:
+        friend class Condition;
+        Mutex(const Mutex&);
+        Mutex& operator=(const Mutex&);
+#ifdef istWindows
+        CRITICAL_SECTION m_cs;
+#else // istWindows
+        pthread_mutex_t m_mutex;
+#endif // istWindows
+    };
+
+    /// 条件変数。wait() は mutex を 1 回だけ lock した状態で呼んでください (再帰的に lock していると解放しきれません)
+    class Condition
+    {
+    public:
+#ifdef istWindows
+        Condition()                 { ::InitializeConditionVariable(&m_cond); }
+        ~Condition()                {}
+        void wait(Mutex &m)         { ::SleepConditionVariableCS(&m_cond, &m.m_cs, INFINITE); }
+        void signalAll()            { ::WakeAllConditionVariable(&m_cond); }
+#else // istWindows
+        Condition()                 { pthread_cond_init(&m_cond, NULL); }
+        ~Condition()                { pthread_cond_destroy(&m_cond); }
+        void wait(Mutex &m)         { pthread_cond_wait(&m_cond, &m.m_mutex); }
+        void signalAll()            { pthread_cond_broadcast(&m_cond); }
+#endif // istWindows
+
+    private:
+        Condition(const Condition&);
+        Condition& operator=(const Condition&);
+#ifdef istWindows
+        CONDITION_VARIABLE m_cond;
+#else // istWindows
+        pthread_cond_t m_cond;
+#endif // istWindows
+    };
+
+    /// スコープを抜ける時に unlock します
+    class ScopedLock
+    {
+    public:
+        explicit ScopedLock(Mutex &m) : m_mutex(m) { m_mutex.lock(); }
+        ~ScopedLock() { m_mutex.unlock(); }
+
+    private:
+        ScopedLock(const ScopedLock&);
+        ScopedLock& operator=(const ScopedLock&);
+        Mutex &m_mutex;
+    };
+
+    /// exec() を別スレッドで実行します。run() したら破棄する前に必ず join() してください
+    class Thread
+    {
+    public:
+        Thread() : m_handle(NULL) {}
+        virtual ~Thread() {}
+
+        void run()
+        {
+#ifdef istWindows
+            m_handle = (HANDLE)::_beginthreadex(NULL, 0, &Thread::entry, this, 0, NULL);
+#else // istWindows
+            pthread_create(&m_thread, NULL, &Thread::entry, this);
+            m_handle = this;
+#endif // istWindows
+        }
+
+        void join()
+        {
+            if(m_handle==NULL) { return; }
+#ifdef istWindows
+            ::WaitForSingleObject(m_handle, INFINITE);
+            ::CloseHandle(m_handle);
+#else // istWindows
+            pthread_join(m_thread, NULL);
+#endif // istWindows
+            m_handle = NULL;
+        }
+
+    protected:
+        virtual void exec()=0;
+
+    private:
+        Thread(const Thread&);
+        Thread& operator=(const Thread&);
+#ifdef istWindows
+        static unsigned __stdcall entry(void *p) { static_cast<Thread*>(p)->exec(); return 0; }
+        HANDLE m_handle;
+#else // istWindows
+        static void* entry(void *p) { static_cast<Thread*>(p)->exec(); return NULL; }
+        void *m_handle; // 実行中なら非 NULL
+        pthread_t m_thread;
+#endif // istWindows
+    };
+
+    /// 論理 CPU の数
+    inline size_t GetNumProcessors()
+    {
+#ifdef istWindows
+        SYSTEM_INFO info;
+        ::GetSystemInfo(&info);
+        return info.dwNumberOfProcessors;
+#else // istWindows
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        return n>0 ? size_t(n) : 1;
+#endif // istWindows
+    }
+
+} // namespace ist
+
+#endif // __ist_Thread_h__
@@ -0,0 +1,73 @@
+﻿#ifndef __ist_Unicode_h__
+#define __ist_Unicode_h__
+
+namespace ist {
+
+    static const uint32 UnicodeReplacementChar = 0xfffd;
+
+    /// UTF-8 を UCS-4 に変換します。locale には依存しません。
+    /// src から最大 dst_len 文字分デコードして dst に書き込み、src は読んだ分だけ進めます。戻り値は書き込んだ文字数。
+    /// 不正なバイト列は U+FFFD に置き換えます。
+    inline size_t DecodeUTF8(const char *&src, const char *end, uint32 *dst, size_t dst_len)
+    {
+        const uint8 *s = (const uint8*)src;
+        const uint8 *e = (const uint8*)end;
+        size_t n = 0;
+        while(s<e && n<dst_len) {
+#ifdef __ist_with_SSE__
+            // ASCII が 16 byte 続いている間はまとめて変換
+            while(e-s>=16 && dst_len-n>=16) {
+                __m128i b = _mm_loadu_si128((const __m128i*)s);
+                if(_mm_movemask_epi8(b)!=0) { break; }
+                const __m128i zero = _mm_setzero_si128();
+                __m128i lo = _mm_unpacklo_epi8(b, zero);
+                __m128i hi = _mm_unpackhi_epi8(b, zero);
+                _mm_storeu_si128((__m128i*)(dst+n+ 0), _mm_unpacklo_epi16(lo, zero));
+                _mm_storeu_si128((__m128i*)(dst+n+ 4), _mm_unpackhi_epi16(lo, zero));
+                _mm_storeu_si128((__m128i*)(dst+n+ 8), _mm_unpacklo_epi16(hi, zero));
+                _mm_storeu_si128((__m128i*)(dst+n+12), _mm_unpackhi_epi16(hi, zero));
+                s+=16; n+=16;
+            }
+            if(s==e || n==dst_len) { break; }
+#endif // __ist_with_SSE__
+            uint32 c = *s;
+            if(c<0x80) {
+                dst[n++] = c;
+                ++s;
+                continue;
+            }
+
+            size_t follow;
+            uint32 min;
+            if     ((c&0xe0)==0xc0) { follow=1; min=0x80;    c&=0x1f; }
+            else if((c&0xf0)==0xe0) { follow=2; min=0x800;   c&=0x0f; }
+            else if((c&0xf8)==0xf0) { follow=3; min=0x10000; c&=0x07; }
+            else {
+                dst[n++] = UnicodeReplacementChar;
+                ++s;
+                continue;
+            }
+
+            size_t i = 1;
+            for(; i<=follow; ++i) {
+                if(s+i>=e || (s[i]&0xc0)!=0x80) { break; }
+                c = (c<<6) | (s[i]&0x3f);
+            }
+            if(i<=follow) {
+                // 途中で途切れている。読めた分だけ捨てて次へ
+                dst[n++] = UnicodeReplacementChar;
+                s += i;
+                continue;
+            }
+            // 冗長表現、サロゲート、範囲外は不正扱い
+            if(c<min || (c>=0xd800 && c<=0xdfff) || c>0x10ffff) { c=UnicodeReplacementChar; }
+            dst[n++] = c;
+            s += follow+1;
+        }
+        src = (const char*)s;
+        return n;
+    }
+
+} // namespace ist
+
+#endif // __ist_Unicode_h__
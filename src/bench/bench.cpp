@@ -0,0 +1,566 @@
+﻿// glSpriteFont のマイクロベンチマーク
+//   bench [出力先.json]
+// 結果は JSON で標準出力 (引数があればそのファイル) に書きます。font.sff, font.png はカレントディレクトリから読みます
+// コーパスは全てコード内で決まった内容を生成するので、実行毎に同じ入力になります
+// 内部のクラスを直接計測するため、DLL は使わずに glSpriteFont.cpp をそのまま取り込んでいます
+// 計測の前に FontQuad の量子化の精度を確かめ、float で並べた時と違う画素に丸まる角があれば 1 で終了します
+#include "../glSpriteFont.cpp"
+#include <cstdio>
+#include <cstdlib>
+#include <clocale>
+#include <new>
+
+#ifdef _WIN32
+#   pragma comment(lib,"opengl32.lib")
+#endif // _WIN32
+
+using namespace ist;
+
+
+// operator new 経由の確保回数。libpng などが直接 malloc する分は含みません
+static size_t g_num_allocs = 0;
+
+void* operator new(size_t size)
+{
+    ++g_num_allocs;
+    if(void *p = malloc(size ? size : 1)) { return p; }
+    throw std::bad_alloc();
+}
+void* operator new[](size_t size)
+{
+    ++g_num_allocs;
+    if(void *p = malloc(size ? size : 1)) { return p; }
+    throw std::bad_alloc();
+}
+void operator delete(void *p) throw()   { free(p); }
+void operator delete[](void *p) throw() { free(p); }
+
+
+struct Result
+{
+    stl::string name;
+    size_t iterations;
+    double ns_per_call;
+    double allocs_per_call;
+    size_t glyphs_per_call; // 0 でなければ文字あたりの値も出す
+    size_t bytes_per_call;  // 0 でなければ転送量あたりの値も出す
+};
+static stl::vector<Result> g_results;
+
+static const uint64 MinBatchNS = 20000000;  // 1 batch の最低時間 (20ms)
+static const size_t NumBatches = 7;         // 結果はこの回数の中央値
+
+// f() を 1 batch が MinBatchNS 以上になる回数ずつ NumBatches 回実行し、1 回あたりの時間の中央値を取ります
+// 初回のメモリ確保を除くため、計測前に 1 回実行しておきます
+template<class F>
+static void Run(const char *name, size_t glyphs_per_call, size_t bytes_per_call, F f)
+{
+    f();
+    size_t n = 1;
+    for(;;) {
+        const uint64 t = GetTimeNS();
+        for(size_t i=0; i<n; ++i) { f(); }
+        if(GetTimeNS()-t>=MinBatchNS || n>=(size_t(1)<<24)) { break; }
+        n *= 2;
+    }
+
+    double samples[NumBatches];
+    size_t allocs = 0;
+    for(size_t b=0; b<NumBatches; ++b) {
+        const size_t a = g_num_allocs;
+        const uint64 t = GetTimeNS();
+        for(size_t i=0; i<n; ++i) { f(); }
+        samples[b] = double(GetTimeNS()-t)/double(n);
+        allocs += g_num_allocs-a;
+    }
+    stl::sort(samples, samples+NumBatches);
+
+    Result r;
+    r.name = name;
+    r.iterations = n*NumBatches;
+    r.ns_per_call = samples[NumBatches/2];
+    r.allocs_per_call = double(allocs)/double(r.iterations);
+    r.glyphs_per_call = glyphs_per_call;
+    r.bytes_per_call = bytes_per_call;
+    g_results.push_back(r);
+    fprintf(stderr, "%-40s %12.1f ns/call\n", name, r.ns_per_call);
+}
+
+static void WriteJSON(FILE *f)
+{
+    fprintf(f, "{\n  \"results\": [\n");
+    for(size_t i=0; i<g_results.size(); ++i) {
+        const Result &r = g_results[i];
+        fprintf(f, "    {\"name\": \"%s\", \"iterations\": %u, \"ns_per_call\": %.1f, \"allocs_per_call\": %.3f",
+            r.name.c_str(), unsigned(r.iterations), r.ns_per_call, r.allocs_per_call);
+        if(r.glyphs_per_call>0) {
+            fprintf(f, ", \"glyphs_per_call\": %u, \"glyphs_per_sec\": %.0f, \"ns_per_glyph\": %.3f",
+                unsigned(r.glyphs_per_call), double(r.glyphs_per_call)*1000000000.0/r.ns_per_call, r.ns_per_call/double(r.glyphs_per_call));
+        }
+        if(r.bytes_per_call>0) {
+            fprintf(f, ", \"bytes_per_call\": %u, \"mb_per_sec\": %.1f",
+                unsigned(r.bytes_per_call), double(r.bytes_per_call)*1000.0/r.ns_per_call);
+        }
+        fprintf(f, "}%s\n", i+1<g_results.size() ? "," : "");
+    }
+    fprintf(f, "  ]\n}\n");
+}
+
+
+// コーパス。1 回の計測で lines を全て並べます
+struct Corpus
+{
+    const char *name;
+    stl::vector<stl::wstring> lines;
+    stl::vector<stl::string> lines_utf8;
+    size_t num_chars;
+};
+
+static stl::string ToUTF8(const stl::wstring &ws)
+{
+    stl::string r;
+    for(size_t i=0; i<ws.size(); ++i) {
+        const uint32 c = uint32(ws[i]);
+        if(c<0x80)          { r+=char(c); }
+        else if(c<0x800)    { r+=char(0xc0|(c>>6));  r+=char(0x80|(c&0x3f)); }
+        else if(c<0x10000)  { r+=char(0xe0|(c>>12)); r+=char(0x80|((c>>6)&0x3f)); r+=char(0x80|(c&0x3f)); }
+        else                { r+=char(0xf0|(c>>18)); r+=char(0x80|((c>>12)&0x3f)); r+=char(0x80|((c>>6)&0x3f)); r+=char(0x80|(c&0x3f)); }
+    }
+    return r;
+}
+
+static stl::wstring Widen(const char *s)
+{
+    stl::wstring r;
+    for(; *s; ++s) { r+=wchar_t(*s); }
+    return r;
+}
+
+static void AddLine(Corpus &c, const stl::wstring &line)
+{
+    c.lines.push_back(line);
+    c.lines_utf8.push_back(ToUTF8(line));
+    c.num_chars += line.size();
+}
+
+// 日本語は実行環境の文字コードに左右されないよう、全て wchar_t のリテラルで持つ
+static void MakeCorpora(stl::vector<Corpus> &corpora)
+{
+    static const size_t NumLines = 64;
+    uint32 seed = 12345;
+    Corpus c;
+
+    c.name = "ascii"; c.lines.clear(); c.lines_utf8.clear(); c.num_chars = 0;
+    for(size_t i=0; i<NumLines; ++i) {
+        AddLine(c, Widen(i%2==0 ? "The quick brown fox jumps over the lazy dog." : "Score: 0012345  Lives: 3  Stage 1-2  FPS 60.0"));
+    }
+    corpora.push_back(c);
+
+    c.name = "japanese"; c.lines.clear(); c.lines_utf8.clear(); c.num_chars = 0;
+    for(size_t i=0; i<NumLines; ++i) {
+        AddLine(c, i%2==0 ? L"吾輩は猫である。名前はまだ無い。どこで生れたかとんと見当がつかぬ。"
+                          : L"何でも薄暗いじめじめした所でニャーニャー泣いていた事だけは記憶している。");
+    }
+    corpora.push_back(c);
+
+    c.name = "mixed"; c.lines.clear(); c.lines_utf8.clear(); c.num_chars = 0;
+    for(size_t i=0; i<NumLines; ++i) {
+        AddLine(c, i%2==0 ? L"HP 120/300  状態: 毒 (残り 3 ターン)  所持金 4520G"
+                          : L"ステージ 1-2 クリア! Score: 0012345 ランク A+");
+    }
+    corpora.push_back(c);
+
+    // 200 文字前後のログ行。数値は固定の seed の線形合同法で作る
+    c.name = "log"; c.lines.clear(); c.lines_utf8.clear(); c.num_chars = 0;
+    for(size_t i=0; i<NumLines; ++i) {
+        char buf[512];
+        int len = sprintf(buf, "[2012-05-01 12:%02u:%02u.%03u] INFO  worker-%u: processed %u items in %u ms",
+            unsigned(i/60), unsigned(i%60), unsigned(seed%1000), unsigned(i%8), unsigned(seed%100000), unsigned((seed>>8)%1000));
+        while(len<200) {
+            seed = seed*1103515245+12345;
+            len += sprintf(buf+len, " key%u=%08x", unsigned(len%7), seed);
+        }
+        AddLine(c, Widen(buf));
+    }
+    corpora.push_back(c);
+}
+
+static bool ReadFile(const char *path, stl::vector<char> &out)
+{
+    FileStream f(path, "rb");
+    if(!f.isOpened()) { return false; }
+    f.setReadPos(0, IBinaryStream::Seek_End);
+    out.resize(size_t(f.getReadPos()));
+    f.setReadPos(0);
+    if(!out.empty()) { f.read(&out[0], out.size()); }
+    return true;
+}
+
+// img を一旦 path に保存して、ファイルの中身を読み込む
+static bool Encode(const Image &img, const char *path, Image::FileType ft, stl::vector<char> &out)
+{
+    Image::IOConfig conf;
+    conf.setFileType(ft);
+    bool r = img.save(path, conf) && ReadFile(path, out);
+    remove(path);
+    return r;
+}
+
+
+// 量子化して頂点に展開した文字の角が、量子化せずに float で並べた時 (FontQuad を詰める前の計算) と同じ画素に丸まるか
+// 角の誤差は量子化の 1 段分 (位置と右下の角の丸めで半分ずつ) までなので、画素の境目からそれより近い角は比べません
+static bool CheckQuantization(const SFFFont &font, const Image &atlas, const stl::vector<Corpus> &corpora)
+{
+    static const uint32 Screens[][2] = {{1280, 720}, {1920, 1080}, {3840, 2160}};
+    static const float32 Sizes[] = {12.0f, 16.0f, 24.0f, 36.0f};
+    const GlyphIndexTable &index = font.getIndexTable();
+    const uint16 *glyph_size = font.getGlyphSize();
+    const float32 *unit_width = font.getUnitWidth();
+    const float32 *unit_offset = font.getUnitOffset();
+    bool ok = true;
+    for(size_t si=0; si<_countof(Screens); ++si) {
+        const vec2 screen_size = vec2(float32(Screens[si][0]), float32(Screens[si][1]));
+        const mat4 screen = glm::ortho(0.0f, screen_size.x, screen_size.y, 0.0f);
+        GLFontBackend::RenderState rs;
+        rs.matrix = screen;
+        rs.rcp_tex_size = vec4(1.0f/float32(atlas.width()), 1.0f/float32(atlas.height()), float32(atlas.height()), 0.0f);
+        // 量子化した clip 座標 1 段分の pixel 数 + half float の scale の丸め
+        const float32 tolerance = screen_size.x*0.5f/FontQuadPosScale + 1.0f/256.0f;
+        size_t num_corners = 0, num_skipped = 0, num_mismatch = 0;
+        float32 max_error = 0.0f;
+        stl::vector<FontQuad> quads;
+        stl::vector<GLFontBackend::VertexT> vertices;
+        for(size_t zi=0; zi<_countof(Sizes); ++zi) {
+            const float32 size = Sizes[zi];
+            const float32 glyph_scale = size/font.getFontSize();
+            FSS fss;
+            fss.setFont(&font);
+            fss.setScreenMatrix(screen);
+            fss.setSize(size);
+            for(size_t ci=0; ci<corpora.size(); ++ci) {
+                const Corpus &c = corpora[ci];
+                for(size_t li=0; li<c.lines.size(); ++li) {
+                    const stl::wstring &line = c.lines[li];
+                    // 1/3 pixel 刻みで半端な位置から並べる。行は全て画面に収まる
+                    const vec2 pos = vec2(float32(li%7)/3.0f + float32(si*5), float32(li)*size*0.5f + float32(zi)/3.0f);
+                    if(pos.y+size>screen_size.y) { break; }
+                    quads.clear();
+                    fss.makeQuads(pos, line.c_str(), line.size(), quads);
+                    vertices.resize(quads.size()*4);
+                    if(!quads.empty()) { GLFontBackend::expandQuads(rs, &quads[0], quads.size(), &vertices[0]); }
+
+                    float32 x = pos.x;
+                    size_t qi = 0;
+                    for(size_t i=0; i<line.size(); ++i) {
+                        const uint32 di = index[uint32(line[i])];
+                        if(di==GlyphIndexTable::Invalid) {
+                            x += line[i]<=0xff ? size*0.5f : size;
+                            continue;
+                        }
+                        const float32 offset = unit_offset[di]*size;
+                        const float32 ref[4] = {
+                            x+offset, pos.y,
+                            x+offset+float32(glyph_size[di]&0xff)*glyph_scale, pos.y+float32(glyph_size[di]>>8)*glyph_scale};
+                        x += unit_width[di]*size + offset;
+                        if(qi>=quads.size()) { continue; }
+                        const GLFontBackend::VertexT &v0 = vertices[qi*4+0], &v1 = vertices[qi*4+2];
+                        ++qi;
+                        const float32 got[4] = {
+                            (float32(v0.pos[0])/FontQuadPosScale+1.0f)*0.5f*screen_size.x, (1.0f-float32(v0.pos[1])/FontQuadPosScale)*0.5f*screen_size.y,
+                            (float32(v1.pos[0])/FontQuadPosScale+1.0f)*0.5f*screen_size.x, (1.0f-float32(v1.pos[1])/FontQuadPosScale)*0.5f*screen_size.y};
+                        for(int k=0; k<4; ++k) {
+                            ++num_corners;
+                            max_error = stl::max<float32>(max_error, glm::abs(got[k]-ref[k]));
+                            const float32 frac = ref[k]-floor(ref[k]);
+                            if(glm::abs(frac-0.5f)<=tolerance) { ++num_skipped; continue; }
+                            if(floor(got[k]+0.5f)!=floor(ref[k]+0.5f)) { ++num_mismatch; }
+                        }
+                    }
+                    if(qi!=quads.size()) { ++num_mismatch; }
+                }
+            }
+        }
+        const bool passed = num_mismatch==0 && max_error<=tolerance;
+        fprintf(stderr, "check/quantize/%ux%u corners=%u skipped=%u mismatch=%u max_error=%.4fpx %s\n",
+            unsigned(Screens[si][0]), unsigned(Screens[si][1]), unsigned(num_corners), unsigned(num_skipped), unsigned(num_mismatch), max_error, passed ? "ok" : "NG");
+        ok = ok && passed;
+    }
+    return ok;
+}
+
+
+int main(int argc, char *argv[])
+{
+    stl::vector<char> sff_data, png_data;
+    if(!ReadFile("font.sff", sff_data) || !ReadFile("font.png", png_data)) {
+        fprintf(stderr, "font.sff, font.png が読めません\n");
+        return 1;
+    }
+
+    SFFFont font;
+    Image atlas;
+    {
+        IntrusiveMemoryStream sff(&sff_data[0], sff_data.size());
+        IntrusiveMemoryStream png(&png_data[0], png_data.size());
+        if(!font.load(sff) || !atlas.load(png)) {
+            fprintf(stderr, "font.sff, font.png の読み込みに失敗しました\n");
+            return 1;
+        }
+        font.setSheetSize(atlas.width(), atlas.height(), 1);
+    }
+
+    stl::vector<Corpus> corpora;
+    MakeCorpora(corpora);
+    if(!CheckQuantization(font, atlas, corpora)) {
+        fprintf(stderr, "量子化した位置が float で並べた時と違う画素に丸まっています\n");
+        return 1;
+    }
+    const mat4 screen = glm::ortho(0.0f, 1920.0f, 1080.0f, 0.0f);
+    char name[128];
+
+    // FSS::makeQuads
+    for(size_t ci=0; ci<corpora.size(); ++ci) {
+        const Corpus &c = corpora[ci];
+        FSS fss;
+        fss.setFont(&font);
+        fss.setScreenMatrix(screen);
+        fss.setSize(16.0f);
+        stl::vector<FontQuad> quads;
+        sprintf(name, "fss/make_quads/%s", c.name);
+        Run(name, c.num_chars, 0, [&]() {
+            quads.clear();
+            for(size_t i=0; i<c.lines.size(); ++i) {
+                fss.makeQuads(vec2(0.0f, float32(i)*16.0f), c.lines[i].c_str(), c.lines[i].size(), quads);
+            }
+        });
+    }
+
+    // addText(const char*) の文字コード変換。DecodeUTF8() と、以前の mbstowcs() で std::wstring に変換する方法
+    // mbstowcs() は UTF-8 のロケールでしか日本語を変換できないので、変換できなかったコーパスは飛ばします
+    {
+        static const char *Locales[] = {".UTF-8", "C.UTF-8", "en_US.UTF-8", ""};
+        for(size_t i=0; i<_countof(Locales); ++i) {
+            if(setlocale(LC_CTYPE, Locales[i])) { break; }
+        }
+        for(size_t ci=0; ci<corpora.size(); ++ci) {
+            const Corpus &c = corpora[ci];
+            size_t num_bytes = 0;
+            for(size_t i=0; i<c.lines_utf8.size(); ++i) { num_bytes += c.lines_utf8[i].size(); }
+            size_t num_decoded = 0;
+            sprintf(name, "utf8/decode/%s", c.name);
+            Run(name, c.num_chars, num_bytes, [&]() {
+                uint32 buf[256];
+                num_decoded = 0;
+                for(size_t i=0; i<c.lines_utf8.size(); ++i) {
+                    const char *text = c.lines_utf8[i].c_str();
+                    const char *end = text+c.lines_utf8[i].size();
+                    while(text<end) { num_decoded += DecodeUTF8(text, end, buf, _countof(buf)); }
+                }
+            });
+
+            bool convertible = true;
+            for(size_t i=0; i<c.lines_utf8.size() && convertible; ++i) {
+                convertible = mbstowcs(NULL, c.lines_utf8[i].c_str(), 0)==c.lines[i].size();
+            }
+            if(!convertible) {
+                fprintf(stderr, "utf8/mbstowcs/%s: このロケールでは変換できないので飛ばします\n", c.name);
+                continue;
+            }
+            sprintf(name, "utf8/mbstowcs/%s", c.name);
+            Run(name, c.num_chars, num_bytes, [&]() {
+                num_decoded = 0;
+                for(size_t i=0; i<c.lines_utf8.size(); ++i) {
+                    stl::string tmp(c.lines_utf8[i]);
+                    const size_t wlen = mbstowcs(NULL, tmp.c_str(), 0);
+                    if(wlen==size_t(-1)) { continue; }
+                    stl::wstring wtext;
+                    wtext.resize(wlen);
+                    mbstowcs(&wtext[0], tmp.c_str(), wlen);
+                    num_decoded += wtext.size();
+                }
+            });
+        }
+    }
+
+    // 画面の大半が外にあるスクロールリストと、クリップ矩形で切り取るパネル
+    {
+        const Corpus &c = corpora[0];
+        FSS fss;
+        fss.setFont(&font);
+        fss.setScreenMatrix(screen);
+        fss.setSize(16.0f);
+        stl::vector<FontQuad> quads;
+        const size_t num_lines = 4096;
+        size_t num_chars = 0;
+        for(size_t i=0; i<num_lines; ++i) { num_chars += c.lines[i%c.lines.size()].size(); }
+        Run("fss/scroll_list", num_chars, 0, [&]() {
+            quads.clear();
+            for(size_t i=0; i<num_lines; ++i) {
+                const stl::wstring &line = c.lines[i%c.lines.size()];
+                fss.makeQuads(vec2(0.0f, float32(i)*16.0f-16.0f*1024.0f), line.c_str(), line.size(), quads);
+            }
+        });
+        fss.setClipRect(vec4(100.0f, 100.0f, 500.0f, 400.0f));
+        Run("fss/clip_rect", num_chars, 0, [&]() {
+            quads.clear();
+            for(size_t i=0; i<num_lines; ++i) {
+                const stl::wstring &line = c.lines[i%c.lines.size()];
+                fss.makeQuads(vec2(0.0f, float32(i)*16.0f-16.0f*1024.0f), line.c_str(), line.size(), quads);
+            }
+        });
+    }
+
+    // addText (UTF-8 / wchar_t)。描画しない backend で flush まで含める
+    {
+        IntrusiveMemoryStream sff(&sff_data[0], sff_data.size());
+        IntrusiveMemoryStream png(&png_data[0], png_data.size());
+        glIFontRenderer *renderer = CreateNullSpriteFont(sff, png);
+        renderer->setScreen(0.0f, 1920.0f, 1080.0f, 0.0f);
+        renderer->setSize(16.0f);
+        for(size_t ci=0; ci<corpora.size(); ++ci) {
+            const Corpus &c = corpora[ci];
+            sprintf(name, "renderer/add_text_utf8/%s", c.name);
+            Run(name, c.num_chars, 0, [&]() {
+                for(size_t i=0; i<c.lines_utf8.size(); ++i) {
+                    renderer->addText(0.0f, float32(i)*16.0f, c.lines_utf8[i].c_str(), c.lines_utf8[i].size());
+                }
+                renderer->flush();
+            });
+            sprintf(name, "renderer/add_text_wchar/%s", c.name);
+            Run(name, c.num_chars, 0, [&]() {
+                for(size_t i=0; i<c.lines.size(); ++i) {
+                    renderer->addText(0.0f, float32(i)*16.0f, c.lines[i].c_str(), c.lines[i].size());
+                }
+                renderer->flush();
+            });
+        }
+        // 4 つの layer に交互に追加して flush() で並べ替える
+        {
+            const Corpus &c = corpora[0];
+            Run("renderer/interleaved_layers", c.num_chars, 0, [&]() {
+                for(size_t i=0; i<c.lines.size(); ++i) {
+                    renderer->setLayer(int(i%4));
+                    renderer->addText(0.0f, float32(i)*16.0f, c.lines[i].c_str(), c.lines[i].size());
+                }
+                renderer->flush();
+            });
+            renderer->setLayer(0);
+        }
+        // 縁取りのある行とない行を交互に追加して flush() で設定毎にまとめる
+        {
+            const Corpus &c = corpora[0];
+            Run("renderer/interleaved_effects", c.num_chars, 0, [&]() {
+                for(size_t i=0; i<c.lines.size(); ++i) {
+                    renderer->setOutline(i%2 ? 2.0f : 0.0f, 0.0f, 0.0f, 0.0f, 1.0f);
+                    renderer->addText(0.0f, float32(i)*16.0f, c.lines[i].c_str(), c.lines[i].size());
+                }
+                renderer->flush();
+            });
+            renderer->setOutline(0.0f, 0.0f, 0.0f, 0.0f, 0.0f);
+        }
+        renderer->release();
+    }
+
+    // flush() で GPU のバッファに書く処理。非 instanced 時は 4 頂点への展開、instanced 時は FontQuad のコピーで、bytes_per_call は書く量
+    // 書き先は map した領域の代わりの配列です
+    for(size_t ci=0; ci<corpora.size(); ++ci) {
+        const Corpus &c = corpora[ci];
+        FSS fss;
+        fss.setFont(&font);
+        fss.setScreenMatrix(screen);
+        fss.setSize(16.0f);
+        stl::vector<FontQuad> quads;
+        for(size_t i=0; i<c.lines.size(); ++i) {
+            fss.makeQuads(vec2(0.0f, float32(i)*16.0f), c.lines[i].c_str(), c.lines[i].size(), quads);
+        }
+        GLFontBackend::RenderState rs;
+        rs.matrix = screen;
+        rs.rcp_tex_size = vec4(1.0f/float32(atlas.width()), 1.0f/float32(atlas.height()), float32(atlas.height()), 0.0f);
+        stl::vector<GLFontBackend::VertexT> vertices(quads.size()*4);
+        sprintf(name, "gl/expand_quads/%s", c.name);
+        Run(name, quads.size(), sizeof(GLFontBackend::VertexT)*vertices.size(), [&]() {
+            GLFontBackend::expandQuads(rs, &quads[0], quads.size(), &vertices[0]);
+        });
+        stl::vector<FontQuad> records(quads.size());
+        sprintf(name, "gl/instanced_records/%s", c.name);
+        Run(name, quads.size(), sizeof(FontQuad)*records.size(), [&]() {
+            memcpy(&records[0], &quads[0], sizeof(FontQuad)*quads.size());
+        });
+    }
+
+    // SFF の読み込み。メモリ上のストリームからと、ファイルをマップする load(path) (マップと解除を含む)
+    Run("sff/load/stream", 0, sff_data.size(), [&]() {
+        IntrusiveMemoryStream sff(&sff_data[0], sff_data.size());
+        SFFFont f;
+        f.load(sff);
+    });
+    Run("sff/load/mapped", 0, sff_data.size(), [&]() {
+        SFFFont f;
+        f.load("font.sff");
+    });
+
+    // 画像の読み込みと alpha の抽出。BMP/TGA は font.png を変換して作る
+    {
+        struct Format { const char *name; Image::FileType type; stl::vector<char> data; };
+        Format formats[3];
+        formats[0].name = "png"; formats[0].type = Image::FileType_PNG; formats[0].data = png_data;
+        formats[1].name = "bmp"; formats[1].type = Image::FileType_BMP;
+        formats[2].name = "tga"; formats[2].type = Image::FileType_TGA;
+        Encode(atlas, "bench_tmp.bmp", Image::FileType_BMP, formats[1].data);
+        Encode(atlas, "bench_tmp.tga", Image::FileType_TGA, formats[2].data);
+        for(size_t i=0; i<_countof(formats); ++i) {
+            Format &f = formats[i];
+            if(f.data.empty()) { continue; }
+            Image::IOConfig conf;
+            conf.setFileType(f.type);
+            Image img;
+            sprintf(name, "image/load/%s", f.name);
+            Run(name, 0, f.data.size(), [&]() {
+                IntrusiveMemoryStream st(&f.data[0], f.data.size());
+                img.load(st, conf);
+            });
+        }
+
+        // 画素の変換。bytes_per_call は入力の大きさ
+        Image alpha;
+        if(atlas.getFormat()==IF_RGBA8U) {
+            Run("image/extract_alpha", 0, atlas.size(), [&]() {
+                ExtractAlpha(atlas, alpha);
+            });
+            Run("image/extract_red/rgba", 0, atlas.size(), [&]() {
+                ExtractRed(atlas, alpha);
+            });
+            Image rgb;
+            TExtract<RGBA_8U, RGB_8U>(atlas, rgb, [](const RGBA_8U &c){ return RGB_8U(c.r, c.g, c.b); });
+            Run("image/extract_red/rgb", 0, rgb.size(), [&]() {
+                ExtractRed(rgb, alpha);
+            });
+            Image swapped;
+            swapped.resize<RGBA_8U>(atlas.width(), atlas.height());
+            Run("image/swap_rb", 0, atlas.size(), [&]() {
+                SwapRB8(atlas.data(), swapped.data(), atlas.width()*atlas.height());
+            });
+            Image f32, u8;
+            Run("image/to_f32", 0, atlas.size(), [&]() {
+                ConvertToF32(atlas, f32);
+            });
+            Run("image/to_u8", 0, f32.size(), [&]() {
+                ConvertToU8(f32, u8);
+            });
+        }
+    }
+
+    if(argc>1) {
+        FILE *f = fopen(argv[1], "wb");
+        if(f==NULL) {
+            fprintf(stderr, "%s に書き込めません\n", argv[1]);
+            return 1;
+        }
+        WriteJSON(f);
+        fclose(f);
+    }
+    else {
+        WriteJSON(stdout);
+    }
+    return 0;
+}
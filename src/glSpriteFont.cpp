@@ -1,5 +1,10 @@
 ﻿#include "stdafx.h"
 #include "Image.h"
+#include "Unicode.h"
+#include "CPU.h"
+#include "Thread.h"
+#include "Misc.h"
+#include "MappedFile.h"
 
 #define glIFR_InterModule __declspec(dllexport)
 #include "glSpriteFont.h"
@@ -107,6 +112,20 @@ struct Texture2DDesc
     {}
 };
 
+// size.z はレイヤー数。data は size.x*size.y の画像を size.z 枚続けて並べたもの
+struct Texture2DArrayDesc
+{
+    I3D_COLOR_FORMAT format;
+    uvec3 size;
+    void *data;
+
+    explicit Texture2DArrayDesc(I3D_COLOR_FORMAT _format=I3D_RGBA8, uvec3 _size=uvec3(0, 0, 0), void *_data=NULL)
+        : format(_format)
+        , size(_size)
+        , data(_data)
+    {}
+};
+
 struct ShaderDesc
 {
     const char *source;
@@ -249,6 +268,93 @@ private:
 };
 
 
+// 毎フレーム書き換える頂点データ用のリングバッファ。
+// バッファを NumRegions 個の区画に分け、1 回の flush の間は現在の区画の空いている所に詰めて書き込みます。
+// fence は flush の終わりの advance() で 1 回だけ置き、前の flush で使った区画に入る時だけその fence を待ちます。
+// map は GL_MAP_UNSYNCHRONIZED_BIT で行うので、ドライバによる暗黙の同期は発生しません。
+class StreamBuffer : public Buffer
+{
+public:
+    static const uint32 NumRegions = 3;
+
+    StreamBuffer(GLuint type, uint32 region_size)
+        : Buffer(BufferDesc(type, GL_STREAM_DRAW, region_size*NumRegions))
+        , m_region_size(region_size)
+        , m_current(0)
+        , m_used(0)
+        , m_map_offset(0)
+    {
+        for(uint32 i=0; i<NumRegions; ++i) { m_fences[i]=NULL; }
+    }
+
+    ~StreamBuffer()
+    {
+        for(uint32 i=0; i<NumRegions; ++i) {
+            if(m_fences[i]) { glDeleteSync(m_fences[i]); }
+        }
+    }
+
+    // 現在の区画の空いている所から size byte を map。書いた位置は getMapOffset() で得られます
+    // 区画に収まらない時は次の区画に移り、GPU がまだその区画を使っていればここで待ちます
+    void* map(uint32 size)
+    {
+        istAssert(size<=m_region_size, "exceeded region size.\n");
+        if(m_used+size > m_region_size) {
+            // 1 回の flush で区画を使い切った。この区画の描画を待てるよう、ここにも fence を置いておく
+            placeFence();
+            m_current = (m_current+1) % NumRegions;
+            m_used = 0;
+        }
+        if(m_used==0) { waitFence(); }
+        m_map_offset = m_region_size*m_current + m_used;
+        const GLuint type = getDesc().type;
+        glBindBuffer(type, m_handle);
+        void *r = glMapBufferRange(type, m_map_offset, size,
+            GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT | GL_MAP_UNSYNCHRONIZED_BIT);
+        istAssert(r!=NULL, "StreamBuffer::map() failed\n");
+        glBindBuffer(type, 0);
+        m_used += size;
+        return r;
+    }
+
+    // flush の描画コマンドを全部発行し終えたら呼ぶ。fence を置いて次の区画に移ります。何も書いていなければ何もしない
+    void advance()
+    {
+        if(m_used==0) { return; }
+        placeFence();
+        m_current = (m_current+1) % NumRegions;
+        m_used = 0;
+    }
+
+    uint32 getRegionSize() const    { return m_region_size; }
+    // 直前の map() で書いた位置 (バッファの先頭からの byte 数)
+    uint32 getMapOffset() const     { return m_map_offset; }
+
+private:
+    void placeFence()
+    {
+        istAssert(m_fences[m_current]==NULL, "StreamBuffer: fence already placed\n");
+        m_fences[m_current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    }
+
+    void waitFence()
+    {
+        GLsync &fence = m_fences[m_current];
+        if(fence!=NULL) {
+            while(glClientWaitSync(fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000)==GL_TIMEOUT_EXPIRED) {}
+            glDeleteSync(fence);
+            fence = NULL;
+        }
+    }
+
+    uint32 m_region_size;
+    uint32 m_current;
+    uint32 m_used;          // 現在の区画に書いた byte 数
+    uint32 m_map_offset;
+    GLsync m_fences[NumRegions];
+};
+
+
 class VertexArray : public DeviceResource
 {
 public:
@@ -276,7 +382,8 @@ public:
         glBindVertexArray(0);
     }
 
-    void setAttributes( Buffer& vb, size_t stride, const VertexDesc *descs, size_t num_descs )
+    // base_offset は vb 内のデータの開始位置。全 desc の offset に加算されます
+    void setAttributes( Buffer& vb, size_t stride, const VertexDesc *descs, size_t num_descs, size_t base_offset=0 )
     {
         glBindVertexArray(m_handle);
         vb.bind();
@@ -285,11 +392,11 @@ public:
             glEnableVertexAttribArray(desc.location);
             // float type
             if(desc.type==GL_HALF_FLOAT || desc.type==GL_FLOAT || desc.type==GL_DOUBLE || desc.normalize) {
-                glVertexAttribPointer(desc.location, desc.num_elements, desc.type, desc.normalize, stride, (GLvoid*)desc.offset);
+                glVertexAttribPointer(desc.location, desc.num_elements, desc.type, desc.normalize, stride, (GLvoid*)(base_offset+desc.offset));
             }
             // integer type
             else {
-                glVertexAttribIPointer(desc.location, desc.num_elements, desc.type, stride, (GLvoid*)desc.offset);
+                glVertexAttribIPointer(desc.location, desc.num_elements, desc.type, stride, (GLvoid*)(base_offset+desc.offset));
             }
             glVertexAttribDivisor(desc.location, desc.divisor);
         }
@@ -386,6 +493,61 @@ private:
     Texture2DDesc m_desc;
 };
 
+class Texture2DArray : public DeviceResource
+{
+public:
+
+    Texture2DArray(const Texture2DArrayDesc &desc)
+        : m_desc(desc)
+    {
+        glGenTextures(1, &m_handle);
+
+        GLint internal_format = 0;
+        GLint format = 0;
+        GLint type = 0;
+        DetectGLFormat(m_desc.format, internal_format, format, type);
+
+        bind();
+        glTexImage3D( TEXTURE_TYPE, 0, internal_format, m_desc.size.x, m_desc.size.y, m_desc.size.z, 0, format, type, m_desc.data );
+        unbind();
+    }
+
+    ~Texture2DArray()
+    {
+        if(m_handle!=0) {
+            glDeleteTextures(1, &m_handle);
+            m_handle = 0;
+        }
+    }
+
+    void bind() const
+    {
+        glBindTexture(TEXTURE_TYPE, m_handle);
+    }
+    void unbind() const
+    {
+        glBindTexture(TEXTURE_TYPE, 0);
+    }
+
+    void bind(uint32 slot) const
+    {
+        glActiveTexture(GL_TEXTURE0+slot);
+        glBindTexture(TEXTURE_TYPE, m_handle);
+    }
+
+    void unbind(uint32 slot) const
+    {
+        glActiveTexture(GL_TEXTURE0+slot);
+        glBindTexture(TEXTURE_TYPE, 0);
+    }
+
+    const Texture2DArrayDesc& getDesc() const { return m_desc; }
+
+private:
+    static const GLuint TEXTURE_TYPE = GL_TEXTURE_2D_ARRAY;
+    Texture2DArrayDesc m_desc;
+};
+
 
 
 template<size_t ShaderType>
@@ -585,6 +747,14 @@ Texture2D* CreateTexture2DFromImage(Image &img, I3D_COLOR_FORMAT format=I3D_COLO
     return new Texture2D(desc);
 }
 
+// img は同じ大きさの num_layers 枚の画像を縦に積んだもの。上から順にレイヤー 0, 1, ... になります (R8 のみ)
+Texture2DArray* CreateTexture2DArrayFromImage(Image &img, uint32 num_layers)
+{
+    if(img.getFormat()!=IF_R8U || num_layers==0 || img.height()%num_layers!=0) { return NULL; }
+    Texture2DArrayDesc desc(I3D_R8, uvec3(img.width(), img.height()/num_layers, num_layers), img.data());
+    return new Texture2DArray(desc);
+}
+
 
 
 
@@ -599,7 +769,7 @@ struct SFF_HEAD
     int32 FontHeight;
     int32 SheetMax;
     int32 FontMax;
-    wchar_t SheetName[64];
+    uint16 SheetName[64]; // UTF-16。wchar_t だと Linux などでサイズが変わるので
     struct {
         uint32 IsVertical	: 1;
         uint32 Pad		: 31;
@@ -617,331 +787,3538 @@ struct SFF_DATA
     uint8 Width;
 };
 
+// 1 文字分の描画情報 (16 byte)。instanced 描画時はこのまま頂点属性として GPU に送ります
 struct FontQuad
 {
-    vec2 pos;
-    vec2 size;
-    vec2 uv_pos;
-    vec2 uv_size;
-    vec4 color;
+    int16 pos[2];   // 左上の位置。clip 座標 × FontQuadPosScale
+    uint16 uv[2];   // テクスチャ上の左上 (texel)。シートは縦に積んだ座標で、v はシート番号 × シートの高さ を足したもの
+    uint32 color;   // RGBA8
+    uint8 size[2];  // テクスチャ上の幅/高さ (texel)
+    uint16 scale;   // 1 texel あたりの表示サイズ (half float)
 };
 
-class FSS
+// clip 座標 [-2,2] を int16 に収める係数。1920 pixel 幅の画面で 1/17 pixel 程度の精度になります
+static const float32 FontQuadPosScale = 32767.0f/2.0f;
+static const float32 FontQuadPosMin = -32768.0f;
+static const float32 FontQuadPosMax = 32767.0f;
+
+// 量子化した clip 座標の全体 (xy が最小、zw が最大)。切り取らない時の矩形
+inline vec4 FontQuadPosRange() { return vec4(FontQuadPosMin, FontQuadPosMin, FontQuadPosMax, FontQuadPosMax); }
+
+inline uint32 PackRGBA8(const vec4 &c)
+{
+    const vec4 v = glm::clamp(c, vec4(0.0f), vec4(1.0f))*255.0f + 0.5f;
+    return uint32(v.r) | (uint32(v.g)<<8) | (uint32(v.b)<<16) | (uint32(v.a)<<24);
+}
+
+inline int16 QuantizePos(float32 v) { return int16(floor(v+0.5f)); }
+
+// 文字コード -> SFF_DATA のインデックス の 2 段テーブル。Unicode 全域 (U+0000-U+10FFFF) を引けます。
+// 256 文字単位のページに分け、グリフが 1 つもないページは全て共有の空ページ (0 番) を指します。
+// ASCII と かな のページは空ページの直後に置き、よく引かれるページがメモリ上で固まるようにしています。
+class GlyphIndexTable
 {
 public:
-    FSS()
+    static const uint32 CodeMax     = 0x110000;
+    static const uint32 PageBits    = 8;
+    static const uint32 PageSize    = 1<<PageBits;
+    static const uint32 NumPages    = CodeMax>>PageBits;
+    static const uint16 Invalid     = 0xffff;
+
+    GlyphIndexTable()
+    {
+        clear();
+    }
+
+    void clear()
+    {
+        m_dir.assign(NumPages, 0);
+        m_pages.assign(PageSize, uint16(Invalid));
+    }
+
+    // flat_table は SFF_HEAD::IndexTbl の形式。num_glyphs 以上の値は無効扱いにします
+    void build(const uint16 *flat_table, uint32 num_codes, uint32 num_glyphs)
+    {
+        clear();
+        const uint32 hot_pages[] = {0x00, 0x30}; // ASCII/Latin-1, かな
+        for(uint32 i=0; i<_countof(hot_pages); ++i) {
+            addPage(hot_pages[i], flat_table, num_codes, num_glyphs);
+        }
+        for(uint32 pi=0; pi<(num_codes>>PageBits); ++pi) {
+            addPage(pi, flat_table, num_codes, num_glyphs);
+        }
+    }
+
+    uint32 operator[](uint32 c) const
+    {
+        if(c>=CodeMax) { return Invalid; }
+        return m_pages[(uint32(m_dir[c>>PageBits])<<PageBits) | (c&(PageSize-1))];
+    }
+
+    size_t getMemoryUsage() const { return (m_dir.size()+m_pages.size())*sizeof(uint16); }
+
+private:
+    void addPage(uint32 pi, const uint16 *flat_table, uint32 num_codes, uint32 num_glyphs)
+    {
+        if(m_dir[pi]!=0 || (pi<<PageBits)>=num_codes) { return; }
+        const uint16 *src = flat_table + (pi<<PageBits);
+        bool empty = true;
+        for(uint32 i=0; i<PageSize; ++i) {
+            if(src[i]<num_glyphs) { empty=false; break; }
+        }
+        if(empty) { return; }
+
+        m_dir[pi] = uint16(m_pages.size()>>PageBits);
+        for(uint32 i=0; i<PageSize; ++i) {
+            m_pages.push_back(src[i]<num_glyphs ? src[i] : uint16(Invalid));
+        }
+    }
+
+    stl::vector<uint16> m_dir;      // ページ番号。0 は空ページ
+    stl::vector<uint16> m_pages;    // PageSize 個ずつ並べたページ本体
+};
+
+
+// 原点からの相対位置で並べた文字列。FSS::placeGlyphRun() で平行移動と色の差し替えだけして使います
+struct GlyphRun
+{
+    stl::vector<FontQuad> quads;
+    vec2 advance;       // 次の文字の位置 (原点からの相対)
+    int16 pos_min[2];   // quads の pos の範囲
+    int16 pos_max[2];
+
+    GlyphRun() { clear(); }
+    void clear()
+    {
+        quads.clear();
+        advance = vec2(0.0f);
+        pos_min[0] = pos_min[1] = int16(FontQuadPosMax);
+        pos_max[0] = pos_max[1] = int16(FontQuadPosMin);
+    }
+};
+
+
+// 読み込んだ sff と、そこから作ったグリフ毎のテーブル。読み込み後は変更しないので、複数のスレッドの FSS から同時に参照できます
+class SFFFont
+{
+public:
+    SFFFont()
         : m_header(NULL)
         , m_data(NULL)
-        , m_color(1.0f, 1.0f, 1.0f, 1.0f)
-        , m_size(0.0f)
-        , m_spacing(1.0f)
-        , m_monospace(false)
+        , m_num_glyphs(0)
+        , m_num_sheets(0)
     {}
 
-    void setTextureSize(const vec2 &v)
+    // ファイルをマップして、ヘッダとグリフ情報はマップした領域を直接指します
+    // 同じフォントを使う renderer やプロセスの間で OS のキャッシュを共有できる。マップできなければ読み込みます
+    // 省けるのはファイルの読み込みとコピーだけで、IndexTbl (64K 個) と SFF_DATA は全て読んで索引とグリフ毎の表をここで作ります
+    // (FSS のレイアウトはグリフ毎の表を添字で直接読むため、文字毎に遅延して作ることはしません)
+    bool load(const char *path)
     {
-        m_tex_size = v;
-        m_rcp_tex_size = vec2(1.0f, 1.0f) / m_tex_size;
-    }
+        if(!m_file.open(path)) {
+            FileStream fs(path, "rb");
+            return fs.isOpened() && load(fs);
+        }
+        const char *p = m_file.data();
+        if(m_file.size()<sizeof(SFF_HEAD) || p[0]!='F' || p[1]!='F' || p[2]!='S') { m_file.close(); return false; }
 
-    void setColor(const vec4 &v){ m_color=v; }
-    void setSize(float32 v)     { m_size=v; }
-    void setSpace(float32 v)    { m_spacing=v; }
-    void setMonospace(bool v)   { m_monospace=v; }
+        const SFF_HEAD *header = (const SFF_HEAD*)p;
+        const size_t num_glyphs = stl::max<int32>(header->FontMax, 0);
+        if(m_file.size() < sizeof(SFF_HEAD)+sizeof(SFF_DATA)*num_glyphs) { m_file.close(); return false; }
+        m_index.build(header->IndexTbl, UCS2_CODE_MAX, num_glyphs);
 
-    float getFontSize() const
-    {
-        return m_header!=NULL ? (float32)m_header->FontSize : 0.0f;
+        stl::vector<char>().swap(m_buf);
+        m_header = header;
+        m_data = (const SFF_DATA*)(p+sizeof(SFF_HEAD));
+        m_num_glyphs = num_glyphs;
+        buildUnitTable();
+        buildSheetTable();
+        return true;
     }
 
     bool load(IBinaryStream &bf)
     {
+        m_file.close();
         bf.setReadPos(0, IBinaryStream::Seek_End);
         m_buf.resize((size_t)bf.getReadPos());
         bf.setReadPos(0);
         bf.read(&m_buf[0], m_buf.size());
-        if(m_buf.size()<4 || !(m_buf[0]=='F', m_buf[1]=='F', m_buf[2]=='S')) { return false; }
+        if(m_buf.size()<sizeof(SFF_HEAD) || m_buf[0]!='F' || m_buf[1]!='F' || m_buf[2]!='S') { return false; }
+
+        const SFF_HEAD *header = (const SFF_HEAD*)&m_buf[0];
+        const size_t num_glyphs = stl::max<int32>(header->FontMax, 0);
+        if(m_buf.size() < sizeof(SFF_HEAD)+sizeof(SFF_DATA)*num_glyphs) { return false; }
+        m_index.build(header->IndexTbl, UCS2_CODE_MAX, num_glyphs);
+
+        // 以降 IndexTbl は使わないので、SFF_DATA を詰めてその分のメモリを解放する
+        // (m_header->IndexTbl は参照不可になります)
+        const size_t tbl_pos = offsetof(SFF_HEAD, IndexTbl);
+        const size_t data_size = m_buf.size()-sizeof(SFF_HEAD);
+        ::memmove(&m_buf[tbl_pos], &m_buf[sizeof(SFF_HEAD)], data_size);
+        stl::vector<char>(m_buf.begin(), m_buf.begin()+tbl_pos+data_size).swap(m_buf);
 
         m_header = (const SFF_HEAD*)&m_buf[0];
-        m_data = (const SFF_DATA*)(&m_buf[0]+sizeof(SFF_HEAD));
-        if(m_size==0.0f) { m_size=getFontSize(); }
+        m_data = (const SFF_DATA*)(&m_buf[0]+tbl_pos);
+        m_num_glyphs = num_glyphs;
+        buildUnitTable();
+        buildSheetTable();
         return true;
     }
 
-    void makeQuads(const vec2 &pos, const wchar_t *text, size_t len, stl::vector<FontQuad> &quads) const
+    // 読み込んだシートの大きさと数。num_sheets 番以降のシートにある文字は、幅だけあって何も描かれなくなります
+    void setSheetSize(uint32 width, uint32 height, uint32 num_sheets)
     {
-        if(m_header==NULL) { return; }
+        m_sheet_size = uvec2(width, height);
+        m_num_sheets = num_sheets;
+        buildSheetTable();
+    }
 
-        const float32 base_size = (float32)m_header->FontSize;
-        const float32 scale = m_size / base_size;
-        vec2 base = pos;
-        for(size_t i=0; i<len; ++i) {
-            uint32 di = m_header->IndexTbl[text[i]];
-            float advance = (text[i] <= 0xff ? base_size*0.5f : base_size) * scale * m_spacing;
-            if(di!=0xffff) {
-                const SFF_DATA &cdata = m_data[di];
-                vec2 uv = vec2(cdata.u, cdata.v);
-                vec2 wh = vec2(cdata.w, cdata.h);
-                vec2 scaled_wh = wh * scale;
-                vec2 scaled_offset = vec2(float32(cdata.Offset) * scale, 0.0f);
-                vec2 uv_pos = uv*m_rcp_tex_size;
-                vec2 uv_size = wh * m_rcp_tex_size;
-                FontQuad q = {base+scaled_offset, scaled_wh, uv_pos, uv_size, m_color};
-                quads.push_back(q);
-                if(!m_monospace) { advance = (scaled_wh.x + scaled_offset.x) * m_spacing; }
-            }
-            base.x += advance;
+    bool isLoaded() const { return m_header!=NULL; }
+    uint32 getNumSheets() const { return m_header!=NULL ? uint32(stl::max<int32>(m_header->SheetMax, 1)) : 0; }
+    float32 getFontSize() const { return m_header!=NULL ? (float32)m_header->FontSize : 0.0f; }
+    size_t getNumGlyphs() const { return m_num_glyphs; }
+    const GlyphIndexTable& getIndexTable() const { return m_index; }
+    const SFF_DATA* getGlyphData() const { return m_data; }
+
+    // グリフ毎の情報 (SoA)。添字は SFF_DATA のインデックス
+    const uint32* getGlyphUV() const        { return m_glyph_uv.empty() ? NULL : &m_glyph_uv[0]; }      // FontQuad::uv と同じ texel 座標 x2
+    const uint16* getGlyphSize() const      { return m_glyph_size.empty() ? NULL : &m_glyph_size[0]; }  // w | h<<8
+    const float32* getUnitWidth() const     { return m_unit_width.empty() ? NULL : &m_unit_width[0]; }
+    const float32* getUnitOffset() const    { return m_unit_offset.empty() ? NULL : &m_unit_offset[0]; }
+
+private:
+    // FontSize を 1 とした時の幅とオフセットを作っておく
+    void buildUnitTable()
+    {
+        const float32 rcp_base_size = 1.0f / (float32)m_header->FontSize;
+        m_unit_width.resize(m_num_glyphs);
+        m_unit_offset.resize(m_num_glyphs);
+        for(size_t i=0; i<m_num_glyphs; ++i) {
+            const SFF_DATA &cdata = m_data[i];
+            m_unit_width[i] = float32(cdata.w) * rcp_base_size;
+            m_unit_offset[i] = float32(cdata.Offset) * rcp_base_size;
         }
     }
 
-private:
-    stl::vector<char> m_buf;
+    // FontQuad にそのまま書く左上の texel 座標とサイズ。シート (SFF_DATA::No) は縦に積んだ位置に変換しておく
+    // 読み込まれていないシートの文字や、シートからはみ出す文字はサイズ 0 にします
+    void buildSheetTable()
+    {
+        m_glyph_uv.assign(m_num_glyphs, 0);
+        m_glyph_size.assign(m_num_glyphs, 0);
+        if(m_data==NULL || m_num_sheets==0) { return; }
+        for(size_t i=0; i<m_num_glyphs; ++i) {
+            const SFF_DATA &cdata = m_data[i];
+            if( cdata.No>=m_num_sheets ||
+                uint32(cdata.u)+cdata.w>m_sheet_size.x || uint32(cdata.v)+cdata.h>m_sheet_size.y) { continue; }
+            const uint32 v = cdata.No*m_sheet_size.y + cdata.v;
+            m_glyph_uv[i] = uint32(cdata.u) | (v<<16);
+            m_glyph_size[i] = uint16(cdata.w | (cdata.h<<8));
+        }
+    }
+
+    MappedFile m_file;      // load(path) 時。m_header, m_data はここを指す
+    stl::vector<char> m_buf;    // load(stream) 時。IndexTbl を詰めたもの
     const SFF_HEAD *m_header;
     const SFF_DATA *m_data;
-    vec2 m_tex_size;
-    vec2 m_rcp_tex_size;
-
-    vec4 m_color;
-    float32 m_size;
-    float32 m_spacing;
-    bool m_monospace;
+    size_t m_num_glyphs;
+    GlyphIndexTable m_index;
+    uvec2 m_sheet_size;
+    uint32 m_num_sheets;
+    stl::vector<uint32> m_glyph_uv;
+    stl::vector<uint16> m_glyph_size;
+    stl::vector<float32> m_unit_width;
+    stl::vector<float32> m_unit_offset;
 };
 
 
-const char *g_font_vssrc = "\
-#version 330 core\n\
-struct RenderStates\
-{\
-    mat4 ViewProjectionMatrix;\
-};\
-layout(std140) uniform render_states\
-{\
-    RenderStates u_RS;\
-};\
-layout(location=0) in vec2 ia_VertexPosition;\
-layout(location=1) in vec2 ia_VertexTexcoord;\
-layout(location=2) in vec4 ia_VertexColor;\
-out vec2 vs_Texcoord;\
-out vec4 vs_Color;\
-\
-void main(void)\
-{\
-    vs_Texcoord = ia_VertexTexcoord;\
-    vs_Color    = ia_VertexColor;\
-    gl_Position = u_RS.ViewProjectionMatrix * vec4(ia_VertexPosition, 0.0, 1.0);\
-}\
-";
-
-const char *g_font_pssrc = "\
-#version 330 core\n\
-struct RenderStates\
-{\
-    mat4 ViewProjectionMatrix;\
-};\
-layout(std140) uniform render_states\
-{\
-    RenderStates u_RS;\
-};\
-uniform sampler2D u_Font;\
-in vec2 vs_Texcoord;\
-in vec4 vs_Color;\
-layout(location=0) out vec4 ps_FragColor;\
-\
-void main()\
-{\
-    vec4 color = vs_Color;\
-    color.a *= texture(u_Font, vs_Texcoord).r;\
-    ps_FragColor = vec4(color);\
-}\
-";
-
-
-class SpriteFontRenderer : public glIFontRenderer
+// 文字の並べ方の設定 (色、サイズ、スクリーン等) と、それに従って FontQuad を作る処理
+// フォントは SFFFont を参照するだけなので、スレッド毎に FSS を持てば同じフォントを並行して使えます
+class FSS
 {
 public:
-    struct VertexT
+    // setSize()/setSpacing() の組み合わせ毎に作っておく、拡大率と文字間隔を適用済みのグリフ情報
+    struct ScaledMetrics
     {
-        vec2 pos;
-        vec2 texcoord;
-        vec4 color;
+        float32 size;
+        float32 spacing;
+        float32 mono_half;              // 等幅時の半角 (0xff 以下) の送り幅
+        float32 mono_full;              // 等幅時の全角の送り幅
+        uint16 scale;                   // 1 texel あたりの表示サイズ (half float)
+        stl::vector<float32> offset;    // 表示位置の x オフセット
+        stl::vector<float32> advance;   // プロポーショナル時の送り幅
+        uint32 last_used;
 
-        VertexT() {}
-        VertexT(const vec2 &p, const vec2 &t, const vec4 &c) : pos(p), texcoord(t), color(c) {}
+        ScaledMetrics() : size(0.0f), spacing(0.0f), mono_half(0.0f), mono_full(0.0f), scale(0), last_used(0) {}
     };
-    struct RenderState
+    static const size_t MaxScaledMetrics = 4;
+
+    // 並べ方の設定だけを取り出したもの。フォントの読み込みが終わるまで addText() を貯めておく時に使います
+    struct Settings
     {
-        mat4 matrix;
+        vec2 pos_scale;
+        vec2 pos_offset;
+        uint32 color;
+        float32 size;
+        float32 spacing;
+        bool monospace;
+        bool clip;
+        vec4 clip_rect;
+        float32 clip_margin;
     };
 
-    static const size_t MaxCharsPerDraw = 1024;
-
-public:
-    SpriteFontRenderer()
-        : m_sampler(NULL)
-        , m_texture(NULL)
-        , m_vbo(NULL)
-        , m_ubo(NULL)
-        , m_vs(NULL)
-        , m_ps(NULL)
-        , m_shader(NULL)
-        , m_uniform_loc(0)
+    FSS()
+        : m_font(NULL)
+        , m_scaled_tick(0)
+        , m_pos_scale(FontQuadPosScale, FontQuadPosScale)
+        , m_color(0xffffffff)
+        , m_size(0.0f)
+        , m_spacing(1.0f)
+        , m_monospace(false)
+        , m_clip(false)
+        , m_clip_margin(0.0f)
     {}
 
-    ~SpriteFontRenderer()
+    // font は FSS より長生きである必要があります
+    void setFont(const SFFFont *font)
     {
-        delete m_shader;
-        delete m_ps;
-        delete m_vs;
-        delete m_va;
-        delete m_ubo;
-        delete m_vbo;
-        delete m_sampler;
-        delete m_texture;
+        m_font = font;
+        if(m_size==0.0f && m_font!=NULL) { m_size=m_font->getFontSize(); }
+        for(size_t i=0; i<MaxScaledMetrics; ++i) { m_scaled[i].advance.clear(); }
     }
 
-    bool initialize(IBinaryStream &fss_stream, IBinaryStream &img_stream)
+    // 以降の makeQuads() の位置をこの行列で clip 座標に変換して量子化します。平行移動と拡大縮小のみ反映
+    void setScreenMatrix(const mat4 &m)
     {
-        {
-            Image img, alpha;
-            if(!img.load(img_stream)) { return false; }
-            // alpha だけ抽出。RGBA ではない画像であれば red だけ抽出
-            if(!ExtractAlpha(img, alpha)) { ExtractRed(img, alpha); }
-            m_texture = CreateTexture2DFromImage(alpha);
-        }
-        if(!m_fss.load(fss_stream)) {
-            return false;
-        }
-        m_fss.setTextureSize(vec2(m_texture->getDesc().size));
-        m_sampler = new Sampler(SamplerDesc(GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_LINEAR, GL_LINEAR));
-        m_vbo = new Buffer(BufferDesc(GL_ARRAY_BUFFER, GL_DYNAMIC_DRAW, sizeof(VertexT)*4*MaxCharsPerDraw));
-        m_ubo = new Buffer(BufferDesc(GL_UNIFORM_BUFFER, GL_DYNAMIC_DRAW, sizeof(RenderState)));
-        {
-            m_va = new VertexArray();
-            const VertexDesc descs[] = {
-                {0, GL_FLOAT, 2,  0, false, 0},
-                {1, GL_FLOAT, 2,  8, false, 0},
-                {2, GL_FLOAT, 4, 16, false, 0},
-            };
-            m_va->setAttributes(*m_vbo, sizeof(VertexT), descs, _countof(descs));
-        }
-        m_vs = CreateVertexShaderFromString(g_font_vssrc);
-        m_ps = CreatePixelShaderFromString(g_font_pssrc);
-        m_shader = new ShaderProgram(ShaderProgramDesc(m_vs, m_ps));
-        m_uniform_loc = m_shader->getUniformBlockIndex("render_states");
-
-        return true;
+        m_pos_scale = vec2(m[0][0], m[1][1]) * FontQuadPosScale;
+        m_pos_offset = vec2(m[3][0], m[3][1]) * FontQuadPosScale;
     }
 
-    virtual void release() { delete this; }
+    void setColor(const vec4 &v){ m_color=PackRGBA8(v); }
+    void setSize(float32 v)     { m_size=v; }
+    void setSpace(float32 v)    { m_spacing=v; }
+    void setMonospace(bool v)   { m_monospace=v; }
 
-    virtual void setScreen(float32 left, float32 right, float32 bottom, float32 top)
+    // 以降の makeQuads()/placeGlyphRun() の文字を、位置と同じ座標系の矩形 (xy と zw が対角) で切り取ります
+    // FontQuad のサイズは texel 単位なので、切り取りも texel 単位です。中心が矩形に入っている texel を残すので、境界は最大で半 texel ずれます
+    void setClipRect(const vec4 &v) { m_clip=true; m_clip_rect=v; }
+    void clearClipRect()        { m_clip=false; }
+    // 0 より大きい間は texel を切り取らず、矩形を v (位置と同じ単位) だけ広げた範囲に全く掛からない文字を捨てるだけにします
+    // 縁取り/影を付ける文字用で、その分の切り取りは getPixelClipRect() を受け取った backend が画素単位で行います
+    void setClipMargin(float32 v)   { m_clip_margin=v; }
+
+    // backend で画素単位に切り取る矩形。量子化した clip 座標で xy が最小、zw が最大。切り取らない時は全体です
+    vec4 getPixelClipRect() const
     {
-        m_renderstate.matrix = glm::ortho(left, right, bottom, top);
+        if(!m_clip || m_clip_margin<=0.0f) { return FontQuadPosRange(); }
+        vec2 clip_min, clip_max;
+        getClipBounds(clip_min, clip_max);
+        return vec4(clip_min, clip_max);
     }
-    virtual void setColor(float r, float g, float b, float a)   { m_fss.setColor(vec4(r,g,b,a)); }
-    virtual void setSize(float32 v)         { m_fss.setSize(v); }
-    virtual void setSpacing(float32 v)      { m_fss.setSpace(v); }
-    virtual void setMonospace(bool v)       { m_fss.setMonospace(v); }
 
-    virtual void addText(float x, float y, const char *text, size_t len)
+    // size が 0 (フォントが読まれる前の既定値) ならフォントのサイズを使います
+    void setSettings(const Settings &v)
     {
-        // _alloca() で一時領域高速に取りたいところだが、_alloca() はマルチスレッド非対応っぽいので素直な実装で
-        if(len==0) { len = strlen(text); }
-        stl::string tmp(text, len);
+        m_pos_scale = v.pos_scale;
+        m_pos_offset = v.pos_offset;
+        m_color = v.color;
+        m_size = (v.size==0.0f && m_font!=NULL) ? m_font->getFontSize() : v.size;
+        m_spacing = v.spacing;
+        m_monospace = v.monospace;
+        m_clip = v.clip;
+        m_clip_rect = v.clip_rect;
+        m_clip_margin = v.clip_margin;
+    }
+
+    Settings getSettings() const
+    {
+        Settings r = {m_pos_scale, m_pos_offset, m_color, m_size, m_spacing, m_monospace, m_clip, m_clip_rect, m_clip_margin};
+        return r;
+    }
+
+    const SFFFont* getFont() const  { return m_font; }
+    float32 getSize() const         { return m_size; }
+    float32 getSpacing() const      { return m_spacing; }
+    bool isMonospace() const        { return m_monospace; }
+    const vec2& getPosScale() const { return m_pos_scale; }
+    const vec2& getPosOffset() const{ return m_pos_offset; }
+
+    // CharT は wchar_t か UCS-4 (uint32)。戻り値は最後の文字の次の位置で、続きを書く時の pos になります
+    // 画面外の文字は出力しません
+    template<class CharT>
+    vec2 makeQuads(const vec2 &pos, const CharT *text, size_t len, stl::vector<FontQuad> &quads) const
+    {
+        const size_t first = quads.size();
+        const vec2 r = layout(pos, m_pos_offset, text, len, quads);
+        cullQuads(quads, first);
+        return r;
+    }
+
+    // text は UTF-8。スタック上のバッファに少しずつデコードしながら並べるので、ヒープ確保は発生しません
+    vec2 makeQuadsUTF8(const vec2 &pos, const char *text, size_t len, stl::vector<FontQuad> &quads) const
+    {
+        const char *end = text+len;
+        uint32 buf[256];
+        vec2 p = pos;
+        while(text<end) {
+            size_t n = DecodeUTF8(text, end, buf, _countof(buf));
+            p = makeQuads(p, buf, n, quads);
+        }
+        return p;
+    }
+
+    // 原点からの相対位置で run に追記します。続けて呼ぶと run.advance の位置から続きを並べます
+    template<class CharT>
+    void appendGlyphRun(GlyphRun &run, const CharT *text, size_t len) const
+    {
+        const size_t first = run.quads.size();
+        run.advance = layout(run.advance, vec2(0.0f), text, len, run.quads);
+        for(size_t i=first; i<run.quads.size(); ++i) {
+            const FontQuad &q = run.quads[i];
+            for(size_t k=0; k<2; ++k) {
+                run.pos_min[k] = stl::min<int16>(run.pos_min[k], q.pos[k]);
+                run.pos_max[k] = stl::max<int16>(run.pos_max[k], q.pos[k]);
+            }
+        }
+    }
+
+    // run を pos に平行移動し、現在の色に差し替えて quads に追加します。戻り値は makeQuads() と同じ
+    vec2 placeGlyphRun(const vec2 &pos, const GlyphRun &run, stl::vector<FontQuad> &quads) const
+    {
+        const vec2 origin = pos*m_pos_scale + m_pos_offset;
+        if(run.quads.empty() || !isQuantizable(origin.x) || !isQuantizable(origin.y)) { return pos+run.advance; }
+        const int32 ox = QuantizePos(origin.x);
+        const int32 oy = QuantizePos(origin.y);
+        const size_t first = quads.size();
+        const size_t num = run.quads.size();
+        quads.resize(first+num);
+        FontQuad *dst = &quads[first];
+        const FontQuad *src = &run.quads[0];
+
+        if( ox+run.pos_min[0]>=FontQuadPosMin && ox+run.pos_max[0]<=FontQuadPosMax &&
+            oy+run.pos_min[1]>=FontQuadPosMin && oy+run.pos_max[1]<=FontQuadPosMax)
+        {
+            // 全部範囲内に収まる場合は位置を足して色を書き換えるだけ
+#ifdef __ist_with_SSE__
+            const __m128i offset = _mm_set_epi32(0, 0, 0, (ox&0xffff)|(oy<<16));
+            const __m128i color = _mm_set_epi32(0, m_color, 0, 0);
+            const __m128i mask = _mm_set_epi32(~0, 0, ~0, ~0);
+            for(size_t i=0; i<num; ++i) {
+                __m128i q = _mm_add_epi16(_mm_loadu_si128((const __m128i*)(src+i)), offset);
+                _mm_storeu_si128((__m128i*)(dst+i), _mm_or_si128(_mm_and_si128(q, mask), color));
+            }
+#else // __ist_with_SSE__
+            for(size_t i=0; i<num; ++i) {
+                dst[i] = src[i];
+                dst[i].pos[0] = int16(ox+src[i].pos[0]);
+                dst[i].pos[1] = int16(oy+src[i].pos[1]);
+                dst[i].color = m_color;
+            }
+#endif // __ist_with_SSE__
+        }
+        else {
+            // 画面外にはみ出す文字は捨てる
+            size_t n = 0;
+            for(size_t i=0; i<num; ++i) {
+                const int32 x = ox+src[i].pos[0];
+                const int32 y = oy+src[i].pos[1];
+                if(!isQuantizable(float32(x)) || !isQuantizable(float32(y))) { continue; }
+                dst[n] = src[i];
+                dst[n].pos[0] = int16(x);
+                dst[n].pos[1] = int16(y);
+                dst[n].color = m_color;
+                ++n;
+            }
+            quads.resize(first+n);
+        }
+        cullQuads(quads, first);
+        return pos+run.advance;
+    }
+
+private:
+    template<class CharT>
+    vec2 layout(const vec2 &pos, const vec2 &pos_offset, const CharT *text, size_t len, stl::vector<FontQuad> &quads) const
+    {
+        if(m_font==NULL || !m_font->isLoaded() || len==0) { return pos; }
+
+        // 出力先は最大数 (len) 確保しておいて直接書き込み、最後に実際の数に縮める
+        const size_t first = quads.size();
+        quads.resize(first+len);
+        LayoutContext ctx = {getScaledMetrics(), &quads[first], pos, pos_offset};
+        size_t n = m_monospace ? layoutGlyphs<true>(ctx, text, len) : layoutGlyphs<false>(ctx, text, len);
+        quads.resize(first+n);
+        return ctx.base;
+    }
+
+    struct LayoutContext
+    {
+        const ScaledMetrics &sm;
+        FontQuad *dst;
+        vec2 base;
+        vec2 pos_offset;    // 量子化前に足す値。GlyphRun を作る時は 0
+    };
+
+    static bool isQuantizable(float32 v) { return v>=FontQuadPosMin && v<=FontQuadPosMax; }
+
+    // quads[first] 以降のうち画面 (clip 座標の [-1,1]) に全くかからない文字を捨て、クリップ矩形があればはみ出した texel を切り取る
+    // setClipMargin() が 0 より大きければ切り取らず、広げた矩形に全くかからない文字を捨てるだけです
+    // 画面の端は GPU に任せて切り取りません。1 回の makeQuads() 等で作った文字は全て同じ scale を持っています
+    void cullQuads(stl::vector<FontQuad> &quads, size_t first) const
+    {
+        if(first==quads.size()) { return; }
+        FontQuad *q = &quads[first];
+        const size_t num = quads.size()-first;
+        const vec2 texel = glm::detail::toFloat32(q[0].scale) * m_pos_scale;  // 1 texel の量子化した clip 座標での大きさ。y は負のこともある
+
+        // まず全体の範囲 (文字の大きさは最大の 255 texel と見なす) で判定し、大抵はここで済ませる
+        int32 pmin[2] = {q[0].pos[0], q[0].pos[1]};
+        int32 pmax[2] = {q[0].pos[0], q[0].pos[1]};
+        for(size_t i=1; i<num; ++i) {
+            for(int k=0; k<2; ++k) {
+                pmin[k] = stl::min<int32>(pmin[k], q[i].pos[k]);
+                pmax[k] = stl::max<int32>(pmax[k], q[i].pos[k]);
+            }
+        }
+        bool inside = true;
+        for(int k=0; k<2; ++k) {
+            const float32 ext = 255.0f*texel[k];
+            const float32 lo = float32(pmin[k]) + stl::min<float32>(ext, 0.0f);
+            const float32 hi = float32(pmax[k]) + stl::max<float32>(ext, 0.0f);
+            if(hi<-FontQuadPosScale || lo>FontQuadPosScale) {
+                quads.resize(first);
+                return;
+            }
+            inside = inside && lo>=-FontQuadPosScale && hi<=FontQuadPosScale;
+        }
+        if(inside && !m_clip) { return; }
+
+        vec2 clip_min, clip_max;
+        if(m_clip) { getClipBounds(clip_min, clip_max); }
+        const bool trim = m_clip && m_clip_margin<=0.0f;
+        if(m_clip && !trim) {
+            const vec2 margin = glm::abs(m_pos_scale)*m_clip_margin;
+            clip_min -= margin;
+            clip_max += margin;
+        }
+        size_t n = 0;
+        for(size_t i=0; i<num; ++i) {
+            FontQuad f = q[i];
+            if(!isOnScreen(f, 0, texel.x) || !isOnScreen(f, 1, texel.y)) { continue; }
+            if(trim && (!clipAxis(f, 0, texel.x, clip_min.x, clip_max.x) || !clipAxis(f, 1, texel.y, clip_min.y, clip_max.y))) { continue; }
+            if(m_clip && !trim && (!isInRange(f, 0, texel.x, clip_min.x, clip_max.x) || !isInRange(f, 1, texel.y, clip_min.y, clip_max.y))) { continue; }
+            q[n++] = f;
+        }
+        quads.resize(first+n);
+    }
+
+    // クリップ矩形を量子化した clip 座標にしたもの
+    void getClipBounds(vec2 &clip_min, vec2 &clip_max) const
+    {
+        const vec2 a = vec2(m_clip_rect.x, m_clip_rect.y)*m_pos_scale + m_pos_offset;
+        const vec2 b = vec2(m_clip_rect.z, m_clip_rect.w)*m_pos_scale + m_pos_offset;
+        clip_min = glm::min(a, b);
+        clip_max = glm::max(a, b);
+    }
+
+    // k 軸方向で文字が [lo,hi] に少しでもかかっているか
+    static bool isInRange(const FontQuad &q, int k, float32 t, float32 lo, float32 hi)
+    {
+        const float32 a = q.pos[k];
+        const float32 b = a + float32(q.size[k])*t;
+        return stl::max<float32>(a, b)>=lo && stl::min<float32>(a, b)<=hi;
+    }
+
+    static bool isOnScreen(const FontQuad &q, int k, float32 t) { return isInRange(q, k, t, -FontQuadPosScale, FontQuadPosScale); }
+
+    // k 軸方向で中心が [cmin,cmax] に入っている texel だけを残す。1 つも残らなければ false
+    // texel i の中心は pos+(i+0.5)*t で、t は負のこともあります (y が下向きの画面)
+    static bool clipAxis(FontQuad &q, int k, float32 t, float32 cmin, float32 cmax)
+    {
+        const float32 p = q.pos[k];
+        const int32 n = q.size[k];
+        if(t==0.0f) { return p>=cmin && p<=cmax; }
+        float32 lo = (cmin-p)/t - 0.5f;
+        float32 hi = (cmax-p)/t - 0.5f;
+        if(t<0.0f) { stl::swap(lo, hi); }
+        const int32 i0 = int32(ceil(stl::max<float32>(lo, 0.0f)));
+        const int32 i1 = int32(floor(stl::min<float32>(hi, float32(n-1))));
+        if(i0>i1) { return false; }
+        if(i0>0) {
+            q.pos[k] = QuantizePos(p+float32(i0)*t);
+            q.uv[k] = uint16(q.uv[k]+i0);
+        }
+        q.size[k] = uint8(i1-i0+1);
+        return true;
+    }
+
+    // size_scale は size[2] と scale を下位から詰めたもの
+    static void writeQuad(FontQuad &q, int16 x, int16 y, uint32 uv, uint32 color, uint32 size_scale)
+    {
+        q.pos[0] = x;
+        q.pos[1] = y;
+        q.uv[0] = uint16(uv);
+        q.uv[1] = uint16(uv>>16);
+        q.color = color;
+        q.size[0] = uint8(size_scale);
+        q.size[1] = uint8(size_scale>>8);
+        q.scale = uint16(size_scale>>16);
+    }
+
+    // text[i] から 1 文字取り出して i を進める。wchar_t が UTF-16 の環境ではサロゲートペアを結合
+    template<class CharT>
+    static uint32 fetchChar(const CharT *text, size_t len, size_t &i)
+    {
+        uint32 c = (uint32)text[i++];
+        if(sizeof(CharT)==2 && c>=0xd800 && c<0xdc00 && i<len && uint32(text[i])>=0xdc00 && uint32(text[i])<0xe000) {
+            c = 0x10000 + ((c-0xd800)<<10) + (uint32(text[i++])-0xdc00);
+        }
+        return c;
+    }
+
+    template<bool Monospace>
+    float32 getAdvance(const ScaledMetrics &sm, uint32 c, uint32 di) const
+    {
+        if(!Monospace && di!=GlyphIndexTable::Invalid) { return sm.advance[di]; }
+        return c <= 0xff ? sm.mono_half : sm.mono_full;
+    }
+
+    // ctx.dst に文字を書き込んで ctx.base を進め、書き込んだ数を返します
+    template<bool Monospace, class CharT>
+    size_t layoutGlyphs(LayoutContext &ctx, const CharT *text, size_t len) const
+    {
+        const ScaledMetrics &sm = ctx.sm;
+        const GlyphIndexTable &index = m_font->getIndexTable();
+        const uint32 *glyph_uv = m_font->getGlyphUV();
+        const uint16 *glyph_size = m_font->getGlyphSize();
+        FontQuad *dst = ctx.dst;
+        vec2 base = ctx.base;
+        // y は行内で一定なので 1 回だけ量子化。範囲外なら位置の計算だけ行います
+        const float32 qy = base.y*m_pos_scale.y + ctx.pos_offset.y;
+        const bool y_valid = isQuantizable(qy);
+        const int16 iy = y_valid ? QuantizePos(qy) : 0;
+        const uint32 scale = uint32(sm.scale)<<16;
+        for(size_t i=0; i<len; ) {
+            uint32 c = fetchChar(text, len, i);
+            uint32 di = index[c];
+            if(y_valid && di!=GlyphIndexTable::Invalid) {
+                const float32 qx = (base.x+sm.offset[di])*m_pos_scale.x + ctx.pos_offset.x;
+                if(isQuantizable(qx)) {
+                    writeQuad(*dst++, QuantizePos(qx), iy, glyph_uv[di], m_color, glyph_size[di]|scale);
+                }
+            }
+            base.x += getAdvance<Monospace>(sm, c, di);
+        }
+        ctx.base = base;
+        return dst-ctx.dst;
+    }
+
+    // 現在の size/spacing 用の ScaledMetrics を返す。なければ一番使われていないものを作り直します
+    const ScaledMetrics& getScaledMetrics() const
+    {
+        ScaledMetrics *lru = &m_scaled[0];
+        for(size_t i=0; i<MaxScaledMetrics; ++i) {
+            ScaledMetrics &sm = m_scaled[i];
+            if(!sm.advance.empty() && sm.size==m_size && sm.spacing==m_spacing) {
+                sm.last_used = ++m_scaled_tick;
+                return sm;
+            }
+            if(sm.last_used < lru->last_used) { lru = &sm; }
+        }
+
+        ScaledMetrics &sm = *lru;
+        const float32 scale = m_size;
+        const size_t num_glyphs = m_font->getNumGlyphs();
+        const float32 *unit_width = m_font->getUnitWidth();
+        const float32 *unit_offset = m_font->getUnitOffset();
+        sm.size = m_size;
+        sm.spacing = m_spacing;
+        sm.mono_half = m_size*0.5f*m_spacing;
+        sm.mono_full = m_size*m_spacing;
+        sm.scale = uint16(glm::detail::toFloat16(scale / m_font->getFontSize()));
+        sm.offset.resize(num_glyphs);
+        sm.advance.resize(num_glyphs);
+        for(size_t i=0; i<num_glyphs; ++i) {
+            sm.offset[i] = unit_offset[i] * scale;
+            sm.advance[i] = (unit_width[i]*scale + sm.offset[i]) * m_spacing;
+        }
+        sm.last_used = ++m_scaled_tick;
+        return sm;
+    }
+
+    const SFFFont *m_font;
+    mutable ScaledMetrics m_scaled[MaxScaledMetrics];
+    mutable uint32 m_scaled_tick;
+
+    vec2 m_pos_scale;   // 位置 -> 量子化した clip 座標
+    vec2 m_pos_offset;
+    uint32 m_color;     // RGBA8
+    float32 m_size;
+    float32 m_spacing;
+    bool m_monospace;
+    bool m_clip;
+    vec4 m_clip_rect;   // 位置と同じ座標系。xy と zw が対角
+    float32 m_clip_margin;
+};
+
+
+// order[0..n) を keys[order[i]] の昇順に並べ替えます。同じキーの間の順番は変わりません (8bit 毎の LSD radix sort)
+// tmp は n 個分の作業領域。全ての要素で同じ値になる桁は飛ばすので、キーの種類が少なければほぼ 1 回の走査で済みます
+inline void StableRadixSort(const uint32 *keys, uint32 *order, uint32 *tmp, size_t n)
+{
+    if(n<2) { return; }
+    uint32 *src = order, *dst = tmp;
+    for(uint32 shift=0; shift<32; shift+=8) {
+        size_t count[256] = {0};
+        for(size_t i=0; i<n; ++i) { ++count[(keys[src[i]]>>shift)&0xff]; }
+        if(count[(keys[src[0]]>>shift)&0xff]==n) { continue; }
+        size_t offset = 0;
+        for(size_t d=0; d<256; ++d) {
+            const size_t c = count[d];
+            count[d] = offset;
+            offset += c;
+        }
+        for(size_t i=0; i<n; ++i) { dst[count[(keys[src[i]]>>shift)&0xff]++] = src[i]; }
+        stl::swap(src, dst);
+    }
+    if(src!=order) { stl::copy(src, src+n, order); }
+}
+
+// layer を符号なしの並び順にしたもの
+inline uint32 LayerSortKey(int32 layer) { return uint32(layer)^0x80000000u; }
+
+
+// 縁取りと影の設定 (setOutline()/setShadow())。幅と位置は画面の座標系 (setScreen() の単位) で、texel への換算は文字毎に backend で行います
+// 無効なものは全て 0 にしておき、== で比べられるようにします
+// 縁取り/影のある文字は切った辺に縁取りが付かないよう、setClipRect() の切り取りを clip_rect で backend が画素単位に行います
+struct FontEffect
+{
+    vec4 outline_color;
+    vec4 shadow_color;
+    vec2 shadow_offset;
+    float32 outline_width;
+    vec4 clip_rect;     // 量子化した clip 座標で xy が最小、zw が最大。この外の画素は描きません
+
+    FontEffect() : outline_color(0.0f), shadow_color(0.0f), shadow_offset(0.0f), outline_width(0.0f), clip_rect(FontQuadPosRange()) {}
+
+    void setOutline(float32 width, const vec4 &color)
+    {
+        const bool enabled = width>0.0f && color.a>0.0f;
+        outline_width = enabled ? width : 0.0f;
+        outline_color = enabled ? color : vec4(0.0f);
+    }
+    void setShadow(const vec2 &offset, const vec4 &color)
+    {
+        const bool enabled = color.a>0.0f;
+        shadow_offset = enabled ? offset : vec2(0.0f);
+        shadow_color = enabled ? color : vec4(0.0f);
+    }
+    bool hasOutline() const { return outline_width>0.0f; }
+    bool hasShadow() const  { return shadow_color.a>0.0f; }
+    // 文字の矩形の外に描く幅 (画面の座標系)。FSS::setClipMargin() に渡します
+    float32 getClipMargin() const
+    {
+        return outline_width + stl::max<float32>(glm::abs(shadow_offset.x), glm::abs(shadow_offset.y));
+    }
+
+    bool operator==(const FontEffect &v) const
+    {
+        return outline_color==v.outline_color && shadow_color==v.shadow_color && shadow_offset==v.shadow_offset && outline_width==v.outline_width && clip_rect==v.clip_rect;
+    }
+    bool operator!=(const FontEffect &v) const { return !(*this==v); }
+};
+
+// flush() で文字を並べ替えるキーになる、文字の描き方の状態。setLayer()/setOutline()/setShadow() の値
+struct RunState
+{
+    int32 layer;
+    FontEffect effect;
+    mat4 screen;        // 文字を量子化した時の setScreen() の行列。文字の大きさは描く時の行列で決まるので、同じ行列で描きます
+
+    RunState() : layer(0) {}
+    bool operator==(const RunState &v) const { return layer==v.layer && effect==v.effect && screen==v.screen; }
+    bool operator!=(const RunState &v) const { return !(*this==v); }
+};
+
+
+// FontQuad の列のどこから RunState が変わったか。addText() の度に mark() し、flush() で sort() して layer 順に並べ替えます
+// 変わった所だけ覚えるので、どれも使わなければ 1 つしかできません。縁取り/影とスクリーンは並べ替えのキーにせず、同じ layer の中は追加した順のままです
+class LayerRuns
+{
+public:
+    // RunState 毎に続いている範囲
+    struct Range
+    {
+        RunState state;
+        size_t first;
+        size_t num;
+    };
+
+    // quads の pos 以降に追加する文字の状態
+    void mark(const RunState &state, size_t pos)
+    {
+        if(!m_runs.empty() && m_runs.back().first==pos) {
+            // 前の addText() で文字が 1 つもできなかった
+            m_runs.back().state = state;
+            if(m_runs.size()>1 && m_runs[m_runs.size()-2].state==state) { m_runs.pop_back(); }
+            return;
+        }
+        if(m_runs.empty() || m_runs.back().state!=state) {
+            Run r = {state, pos};
+            m_runs.push_back(r);
+        }
+    }
+
+    // quads の offset 以降に移した src の文字の分を足す
+    void append(const LayerRuns &src, size_t offset)
+    {
+        for(size_t i=0; i<src.m_runs.size(); ++i) { mark(src.m_runs[i].state, src.m_runs[i].first+offset); }
+    }
+
+    // quads を layer の昇順に並べ替え、状態毎の範囲を ranges に入れます。同じ layer の文字は追加した順のままで、縁取り/影やスクリーンが変わる所で範囲を分けます
+    // 既に並んでいれば quads はそのままです。tmp は作業用で、中身は捨てて構いません
+    void sort(stl::vector<FontQuad> &quads, stl::vector<FontQuad> &tmp, stl::vector<Range> &ranges)
+    {
+        ranges.clear();
+        if(quads.empty()) { return; }
+        if(m_runs.empty() || m_runs[0].first!=0) {
+            Run r = {RunState(), 0};
+            m_runs.insert(m_runs.begin(), r);
+        }
+        const size_t num_runs = m_runs.size();
+        m_keys.resize(num_runs);
+        bool sorted = true;
+        for(size_t i=0; i<num_runs; ++i) {
+            m_keys[i] = LayerSortKey(m_runs[i].state.layer);
+            if(i>0 && m_keys[i]<m_keys[i-1]) { sorted=false; }
+        }
+        if(sorted) {
+            for(size_t i=0; i<num_runs; ++i) {
+                const size_t end = i+1<num_runs ? m_runs[i+1].first : quads.size();
+                if(end>m_runs[i].first) { pushRange(ranges, m_runs[i].state, m_runs[i].first, end-m_runs[i].first); }
+            }
+            return;
+        }
+
+        m_order.resize(num_runs*2);
+        for(size_t i=0; i<num_runs; ++i) { m_order[i] = uint32(i); }
+        StableRadixSort(&m_keys[0], &m_order[0], &m_order[num_runs], num_runs);
+        tmp.resize(quads.size());
+        size_t pos = 0;
+        for(size_t i=0; i<num_runs; ++i) {
+            const Run &r = m_runs[m_order[i]];
+            const size_t end = m_order[i]+1<num_runs ? m_runs[m_order[i]+1].first : quads.size();
+            if(end==r.first) { continue; }
+            stl::copy(quads.begin()+r.first, quads.begin()+end, tmp.begin()+pos);
+            pushRange(ranges, r.state, pos, end-r.first);
+            pos += end-r.first;
+        }
+        quads.swap(tmp);
+    }
+
+    void clear() { m_runs.clear(); }
+
+private:
+    struct Run
+    {
+        RunState state;
+        size_t first;   // quads での位置
+    };
+
+    static void pushRange(stl::vector<Range> &ranges, const RunState &state, size_t first, size_t num)
+    {
+        if(!ranges.empty() && ranges.back().state==state) {
+            ranges.back().num += num;
+            return;
+        }
+        Range r = {state, first, num};
+        ranges.push_back(r);
+    }
+
+    stl::vector<Run> m_runs;
+    stl::vector<uint32> m_keys;
+    stl::vector<uint32> m_order;
+};
+
+
+// フォントの読み込みが終わるまでの addText() を、その時点の設定とスクリーンごと貯めておくもの
+// 読み込み後に replay() で追加した順に並べます。スクリーンは state.screen に入っています
+class DeferredTextQueue
+{
+public:
+    template<class CharT>
+    void push(const FSS &fss, const RunState &state, const vec2 &pos, const CharT *text, size_t len)
+    {
+        m_entries.push_back(Entry());
+        Entry &e = m_entries.back();
+        e.settings = fss.getSettings();
+        e.state = state;
+        e.pos = pos;
+        e.text.assign((const char*)text, (const char*)(text+len));
+        e.wide = sizeof(CharT)!=sizeof(char);
+    }
+
+    // 全部並べて空にします。fss の設定は元に戻します
+    void replay(FSS &fss, stl::vector<FontQuad> &quads, LayerRuns &layers)
+    {
+        const FSS::Settings prev = fss.getSettings();
+        for(EntryList::iterator i=m_entries.begin(); i!=m_entries.end(); ++i) {
+            fss.setSettings(i->settings);
+            if(i->text.empty()) { continue; }
+            layers.mark(i->state, quads.size());
+            if(i->wide) { fss.makeQuads(i->pos, (const wchar_t*)&i->text[0], i->text.size()/sizeof(wchar_t), quads); }
+            else        { fss.makeQuadsUTF8(i->pos, &i->text[0], i->text.size(), quads); }
+        }
+        fss.setSettings(prev);
+        m_entries.clear();
+    }
+
+    void clear() { m_entries.clear(); }
+
+private:
+    struct Entry
+    {
+        FSS::Settings settings;
+        RunState state;
+        vec2 pos;
+        stl::vector<char> text;
+        bool wide;
+    };
+    typedef stl::list<Entry> EntryList;
+    EntryList m_entries;
+};
+
+
+// addText() で並べた GlyphRun を (文字列, サイズ, 文字間隔, 等幅) をキーに覚えておくキャッシュ。同じ文字列を毎フレーム追加する UI 向け
+// 予算 (byte) を超えたら最後に使われてから一番時間が経っているものから捨てます。予算 0 (既定) で無効
+class GlyphRunCache
+{
+public:
+    GlyphRunCache() : m_budget(0), m_bytes(0)
+    {
+        ::memset(&m_stats, 0, sizeof(m_stats));
+    }
+
+    void setBudget(size_t bytes) { m_budget=bytes; evict(); }
+    bool isEnabled() const { return m_budget!=0; }
+
+    void clear()
+    {
+        m_stats.evictions += m_entries.size();
+        m_entries.clear();
+        m_map.clear();
+        m_bytes = 0;
+    }
+
+    void getStats(glIFR_LayoutCacheStats &out) const
+    {
+        out = m_stats;
+        out.entries = m_entries.size();
+        out.bytes = m_bytes;
+    }
+
+    // 見つかれば最近使われたものとして先頭に移して返します
+    template<class CharT>
+    const GlyphRun* find(uint64 hash, const FSS &fss, const CharT *text, size_t len)
+    {
+        stl::pair<EntryMap::iterator, EntryMap::iterator> range = m_map.equal_range(hash);
+        for(EntryMap::iterator i=range.first; i!=range.second; ++i) {
+            const Entry &e = *i->second;
+            if( e.size==fss.getSize() && e.spacing==fss.getSpacing() && e.monospace==fss.isMonospace() &&
+                e.char_size==sizeof(CharT) && e.text.size()==len*sizeof(CharT) &&
+                (len==0 || ::memcmp(&e.text[0], text, len*sizeof(CharT))==0))
+            {
+                m_entries.splice(m_entries.begin(), m_entries, i->second);
+                ++m_stats.hits;
+                return &e.run;
+            }
+        }
+        ++m_stats.misses;
+        return NULL;
+    }
+
+    // 新しいエントリを先頭に作って空の GlyphRun を返します。run を埋め終わったら commit() を呼んでください
+    template<class CharT>
+    GlyphRun& insert(uint64 hash, const FSS &fss, const CharT *text, size_t len)
+    {
+        m_entries.push_front(Entry());
+        Entry &e = m_entries.front();
+        e.hash = hash;
+        e.size = fss.getSize();
+        e.spacing = fss.getSpacing();
+        e.monospace = fss.isMonospace();
+        e.char_size = sizeof(CharT);
+        e.text.assign((const char*)text, (const char*)(text+len));
+        m_map.insert(stl::make_pair(hash, m_entries.begin()));
+        return e.run;
+    }
+
+    // 先頭のエントリのメモリ量を数えて、予算を超えていれば古いものから捨てる (作ったばかりのものも捨てることがあります)
+    void commit()
+    {
+        Entry &e = m_entries.front();
+        e.bytes = sizeof(Entry) + sizeof(EntryMap::value_type) + e.text.capacity() + e.run.quads.capacity()*sizeof(FontQuad);
+        m_bytes += e.bytes;
+        evict();
+    }
+
+    // FNV-1a。サイズ等も混ぜておき、同じ文字列の別サイズが同じ値にならないようにします
+    template<class CharT>
+    static uint64 hash(const FSS &fss, const CharT *text, size_t len)
+    {
+        const float32 params[2] = {fss.getSize(), fss.getSpacing()};
+        uint64 h = 14695981039346656037ULL;
+        h = hashBytes(h, params, sizeof(params));
+        h = (h ^ uint64(fss.isMonospace() ? 1 : 0) ^ uint64(sizeof(CharT)<<8)) * 1099511628211ULL;
+        return hashBytes(h, text, len*sizeof(CharT));
+    }
+
+private:
+    struct Entry
+    {
+        uint64 hash;
+        float32 size;
+        float32 spacing;
+        bool monospace;
+        uint32 char_size;           // char 版と wchar_t 版を区別する
+        stl::vector<char> text;     // ハッシュ衝突時の確認用
+        GlyphRun run;
+        size_t bytes;
+
+        Entry() : hash(0), size(0.0f), spacing(0.0f), monospace(false), char_size(0), bytes(0) {}
+    };
+    typedef stl::list<Entry> EntryList;
+    typedef stl::multimap<uint64, EntryList::iterator> EntryMap;
+
+    static uint64 hashBytes(uint64 h, const void *data, size_t size)
+    {
+        const uint8 *p = (const uint8*)data;
+        for(size_t i=0; i<size; ++i) {
+            h = (h ^ p[i]) * 1099511628211ULL;
+        }
+        return h;
+    }
+
+    void evict()
+    {
+        while(m_bytes>m_budget && !m_entries.empty()) {
+            EntryList::iterator last = --m_entries.end();
+            stl::pair<EntryMap::iterator, EntryMap::iterator> range = m_map.equal_range(last->hash);
+            for(EntryMap::iterator i=range.first; i!=range.second; ++i) {
+                if(i->second==last) { m_map.erase(i); break; }
+            }
+            m_bytes -= last->bytes;
+            m_entries.erase(last);
+            ++m_stats.evictions;
+        }
+    }
+
+    EntryList m_entries;    // 先頭ほど最近使われたもの
+    EntryMap m_map;
+    size_t m_budget;
+    size_t m_bytes;
+    glIFR_LayoutCacheStats m_stats;
+};
+
+
+class FontAsset;
+
+// 描画の backend。SpriteFontRenderer が並べてまとめた FontQuad の列を受け取って描きます
+// flush() 毎に beginFlush() -> 描く順に drawStaticBlock()/drawQuads() -> endFlush() の順で呼ばれます
+class FontBackend
+{
+public:
+    // 静的テキスト 1 つ分の、backend 側で持っておくデータ
+    class StaticBlock
+    {
+    public:
+        virtual ~StaticBlock() {}
+    };
+
+    virtual ~FontBackend() {}
+
+    // asset は他の renderer と共有しているので、atlas やテクスチャを書き換えてはいけません
+    virtual bool initialize(FontAsset &asset)=0;
+    virtual void setScreenMatrix(const mat4 &m)=0;
+
+    // quads は原点基準で並べた白い文字。num_quad==0 なら NULL を返して構いません
+    virtual StaticBlock* createStaticBlock(const FontQuad *quads, size_t num_quad)=0;
+
+    // stats には描いた文字数や draw call 数、転送量などを endFlush() まで足していきます
+    virtual void beginFlush(glIFR_FlushStats &stats)=0;
+    // origin は量子化した clip 座標での原点、color は文字の色に掛けます
+    virtual void drawStaticBlock(StaticBlock *block, const vec2 &origin, const vec4 &color)=0;
+    virtual void drawQuads(const FontQuad *quads, size_t num_quad)=0;
+    virtual void endFlush()=0;
+
+    // renderer の setLayer() の値。flush() 中は layer の昇順に、その layer の文字を描く前に呼ばれます
+    // isLayered() が false の backend には、静的テキストを挟まない限り layer が変わっても続けて 1 回の drawQuads() で渡します
+    virtual bool isLayered() const { return false; }
+    virtual void setLayer(int32 layer) {}
+    // 以降の drawStaticBlock()/drawQuads() の文字に付ける縁取りと影。beginFlush() の直後は無効
+    virtual void setEffect(const FontEffect &effect) {}
+
+    // CPU で画像に描く backend の描画先 (RGBA8)。それ以外は NULL
+    virtual Image* getCanvas() { return NULL; }
+};
+
+
+// 非 instanced 用。頂点は FontQuad の pos を矩形の角の位置にしたもので、どの角かは gl_VertexID から求めます
+// 縁取りと影の分だけ矩形を広げ、texel 座標と文字の矩形をピクセルシェーダに渡します。幅の texel への換算は文字毎の scale で行います
+const char *g_font_vssrc = "\
+#version 330 core\n\
+struct RenderStates\
+{\
+    mat4 ViewProjectionMatrix;\
+    vec4 RcpTextureSize;\
+};\
+layout(std140) uniform render_states\
+{\
+    RenderStates u_RS;\
+};\
+struct BlockStates\
+{\
+    vec4 Offset;\
+    vec4 Color;\
+};\
+layout(std140) uniform block_states\
+{\
+    BlockStates u_BS;\
+};\
+struct EffectStates\
+{\
+    vec4 OutlineColor;\
+    vec4 ShadowColor;\
+    vec4 Params;\
+    vec4 ClipRect;\
+};\
+layout(std140) uniform effect_states\
+{\
+    EffectStates u_ES;\
+};\
+layout(location=0) in ivec2 ia_VertexPosition;\
+layout(location=1) in uvec2 ia_VertexTexcoord;\
+layout(location=2) in vec4 ia_VertexColor;\
+layout(location=3) in uvec2 ia_VertexTexelSize;\
+layout(location=4) in float ia_VertexScale;\
+out vec2 vs_Texel;\
+out vec2 vs_Position;\
+flat out vec4 vs_Rect;\
+flat out float vs_Layer;\
+flat out vec3 vs_Effect;\
+out vec4 vs_Color;\
+\
+void main(void)\
+{\
+    const vec2 corners[4] = vec2[4](vec2(0.0, 0.0), vec2(0.0, 1.0), vec2(1.0, 1.0), vec2(1.0, 0.0));\
+    vec2 corner = corners[gl_VertexID&3];\
+    float radius = u_ES.Params.x / ia_VertexScale;\
+    vec2 shadow  = u_ES.Params.yz / ia_VertexScale;\
+    vec2 pad_min = vec2(radius) + max(-shadow, 0.0);\
+    vec2 pad_max = vec2(radius) + max(shadow, 0.0);\
+    vec2 scale  = vec2(u_RS.ViewProjectionMatrix[0][0], u_RS.ViewProjectionMatrix[1][1]) * ia_VertexScale;\
+    uint sheet_height = uint(u_RS.RcpTextureSize.z);\
+    uint layer  = ia_VertexTexcoord.y / sheet_height;\
+    vec2 uv     = vec2(ia_VertexTexcoord.x, ia_VertexTexcoord.y - layer*sheet_height);\
+    vec2 size   = vec2(ia_VertexTexelSize);\
+    vs_Texel    = uv + mix(-pad_min, size+pad_max, corner);\
+    vs_Rect     = vec4(uv, uv+size);\
+    vs_Layer    = float(layer);\
+    vs_Effect   = vec3(radius, shadow);\
+    vs_Color    = ia_VertexColor * u_BS.Color;\
+    gl_Position = vec4((vec2(ia_VertexPosition)+u_BS.Offset.xy)/16383.5 + mix(-pad_min, pad_max, corner)*scale, 0.0, 1.0);\
+    vs_Position = gl_Position.xy*16383.5;\
+}\
+";
+
+// 塗り、縁取り、影の順に重ねたものを出力します。縁取りは周りの 8 点 (太い時は内側にもう 8 点) の最大値、影は縁取りごとずらしたもの
+// 文字の矩形の外は 0 として扱うので、atlas 上の隣の文字は拾いません。ClipRect (量子化した clip 座標) の外の画素は捨てます
+const char *g_font_pssrc = "\
+#version 330 core\n\
+struct RenderStates\
+{\
+    mat4 ViewProjectionMatrix;\
+    vec4 RcpTextureSize;\
+};\
+layout(std140) uniform render_states\
+{\
+    RenderStates u_RS;\
+};\
+struct EffectStates\
+{\
+    vec4 OutlineColor;\
+    vec4 ShadowColor;\
+    vec4 Params;\
+    vec4 ClipRect;\
+};\
+layout(std140) uniform effect_states\
+{\
+    EffectStates u_ES;\
+};\
+uniform sampler2DArray u_Font;\
+in vec2 vs_Texel;\
+in vec2 vs_Position;\
+flat in vec4 vs_Rect;\
+flat in float vs_Layer;\
+flat in vec3 vs_Effect;\
+in vec4 vs_Color;\
+layout(location=0) out vec4 ps_FragColor;\
+\
+float coverage(vec2 t)\
+{\
+    if(any(lessThan(t, vs_Rect.xy)) || any(greaterThan(t, vs_Rect.zw))) { return 0.0; }\
+    return texture(u_Font, vec3(t*u_RS.RcpTextureSize.xy, vs_Layer)).r;\
+}\
+\
+float dilate(vec2 t, float radius)\
+{\
+    const vec2 dirs[8] = vec2[8](vec2(1.0, 0.0), vec2(0.7071, 0.7071), vec2(0.0, 1.0), vec2(-0.7071, 0.7071),\
+                                 vec2(-1.0, 0.0), vec2(-0.7071, -0.7071), vec2(0.0, -1.0), vec2(0.7071, -0.7071));\
+    float a = coverage(t);\
+    for(int i=0; i<8; ++i) { a = max(a, coverage(t + dirs[i]*radius)); }\
+    if(radius>2.0) {\
+        for(int i=0; i<8; ++i) { a = max(a, coverage(t + dirs[i]*(radius*0.5))); }\
+    }\
+    return a;\
+}\
+\
+void main()\
+{\
+    if(any(lessThan(vs_Position, u_ES.ClipRect.xy)) || any(greaterThan(vs_Position, u_ES.ClipRect.zw))) { discard; }\
+    vec4 color = vec4(vs_Color.rgb, 1.0) * (vs_Color.a*coverage(vs_Texel));\
+    if(u_ES.OutlineColor.a>0.0) {\
+        float outline = dilate(vs_Texel, vs_Effect.x);\
+        color += vec4(u_ES.OutlineColor.rgb, 1.0) * (u_ES.OutlineColor.a*vs_Color.a*outline*(1.0-color.a));\
+    }\
+    if(u_ES.ShadowColor.a>0.0) {\
+        vec2 t = vs_Texel - vs_Effect.yz;\
+        float shadow = u_ES.OutlineColor.a>0.0 ? dilate(t, vs_Effect.x) : coverage(t);\
+        color += vec4(u_ES.ShadowColor.rgb, 1.0) * (u_ES.ShadowColor.a*vs_Color.a*shadow*(1.0-color.a));\
+    }\
+    ps_FragColor = color.a>0.0 ? vec4(color.rgb/color.a, color.a) : vec4(0.0);\
+}\
+";
+
+// glIFR_Instanced 用。FontQuad 1 個を 1 インスタンスとして受け取り、頂点シェーダで矩形の 4 隅に展開します
+// 位置は量子化済みの clip 座標、サイズは texel 数 × scale に ViewProjectionMatrix の拡大率を掛けて求めます
+// uv は縦に積んだシート上の texel 座標なので、シートの高さで割ってレイヤーとシート内の位置に分けます。縁取りと影は非 instanced 用と同じです
+const char *g_font_instanced_vssrc = "\
+#version 330 core\n\
+struct RenderStates\
+{\
+    mat4 ViewProjectionMatrix;\
+    vec4 RcpTextureSize;\
+};\
+layout(std140) uniform render_states\
+{\
+    RenderStates u_RS;\
+};\
+struct BlockStates\
+{\
+    vec4 Offset;\
+    vec4 Color;\
+};\
+layout(std140) uniform block_states\
+{\
+    BlockStates u_BS;\
+};\
+struct EffectStates\
+{\
+    vec4 OutlineColor;\
+    vec4 ShadowColor;\
+    vec4 Params;\
+    vec4 ClipRect;\
+};\
+layout(std140) uniform effect_states\
+{\
+    EffectStates u_ES;\
+};\
+layout(location=0) in ivec2 ia_InstancePosition;\
+layout(location=1) in uvec2 ia_InstanceTexcoord;\
+layout(location=2) in vec4 ia_InstanceColor;\
+layout(location=3) in uvec2 ia_InstanceTexelSize;\
+layout(location=4) in float ia_InstanceScale;\
+out vec2 vs_Texel;\
+out vec2 vs_Position;\
+flat out vec4 vs_Rect;\
+flat out float vs_Layer;\
+flat out vec3 vs_Effect;\
+out vec4 vs_Color;\
+\
+void main(void)\
+{\
+    vec2 corner = vec2(float(gl_VertexID>>1), float(gl_VertexID&1));\
+    float radius = u_ES.Params.x / ia_InstanceScale;\
+    vec2 shadow  = u_ES.Params.yz / ia_InstanceScale;\
+    vec2 pad_min = vec2(radius) + max(-shadow, 0.0);\
+    vec2 pad_max = vec2(radius) + max(shadow, 0.0);\
+    vec2 size   = vec2(ia_InstanceTexelSize);\
+    vec2 texel  = mix(-pad_min, size+pad_max, corner);\
+    vec2 scale  = vec2(u_RS.ViewProjectionMatrix[0][0], u_RS.ViewProjectionMatrix[1][1]) * ia_InstanceScale;\
+    uint sheet_height = uint(u_RS.RcpTextureSize.z);\
+    uint layer  = ia_InstanceTexcoord.y / sheet_height;\
+    vec2 uv     = vec2(ia_InstanceTexcoord.x, ia_InstanceTexcoord.y - layer*sheet_height);\
+    vs_Texel    = uv + texel;\
+    vs_Rect     = vec4(uv, uv+size);\
+    vs_Layer    = float(layer);\
+    vs_Effect   = vec3(radius, shadow);\
+    vs_Color    = ia_InstanceColor * u_BS.Color;\
+    gl_Position = vec4((vec2(ia_InstancePosition)+u_BS.Offset.xy)/16383.5 + texel*scale, 0.0, 1.0);\
+    vs_Position = gl_Position.xy*16383.5;\
+}\
+";
+
+
+// 同じ .sff と画像から作った renderer の間で共有するもの。グリフ情報と R8 の atlas、GL のテクスチャ/サンプラ/シェーダ
+// atlas は全シートを縦に積んだ 1 枚の画像で、GL では 1 シート 1 レイヤーの GL_TEXTURE_2D_ARRAY にします
+// FontRegistry が参照カウントで管理し、最後の renderer が破棄された時に一緒に破棄されます
+class FontAsset
+{
+public:
+    FontAsset()
+        : m_ref_count(0)
+        , m_num_sheets(0)
+        , m_texture(NULL)
+        , m_sampler(NULL)
+        , m_ps(NULL)
+    {
+        for(uint32 i=0; i<2; ++i) { m_vs[i]=NULL; m_shaders[i]=NULL; }
+    }
+
+    ~FontAsset()
+    {
+        for(uint32 i=0; i<2; ++i) { delete m_shaders[i]; delete m_vs[i]; }
+        delete m_ps;
+        delete m_sampler;
+        delete m_texture;
+    }
+
+    // 画像が 1 つなのでシート 0 だけ読み込みます
+    bool load(IBinaryStream &sff, IBinaryStream &img)
+    {
+        if(!m_font.load(sff)) { return false; }
+        stl::vector<Image> sheets(1);
+        return loadSheet(sheets[0], img) && buildAtlas(sheets);
+    }
+
+    // .sff はファイルをマップして使います
+    // path_to_img に %d があればシート番号に置き換えて、SheetMax 枚のシートを読み込みます。なければその画像をシート 0 とします
+    bool load(const char *path_to_sff, const char *path_to_img)
+    {
+        if(!m_font.load(path_to_sff)) {
+            istPrint("%s load failed\n", path_to_sff);
+            return false;
+        }
+        const stl::string pattern = path_to_img;
+        const size_t pos = pattern.find("%d");
+        const uint32 num_sheets = pos==stl::string::npos ? 1 : m_font.getNumSheets();
+        stl::vector<Image> sheets(num_sheets);
+        for(uint32 i=0; i<num_sheets; ++i) {
+            stl::string path = pattern;
+            if(pos!=stl::string::npos) {
+                char num[16];
+                sprintf(num, "%u", i);
+                path.replace(pos, 2, num);
+            }
+            FileStream img(path.c_str(), "rb");
+            if(!img.isOpened() || !loadSheet(sheets[i], img)) {
+                istPrint("%s load failed\n", path.c_str());
+                return false;
+            }
+        }
+        return buildAtlas(sheets);
+    }
+
+    const SFFFont& getFont() const  { return m_font; }
+    const Image& getAtlas() const   { return m_atlas; }
+    uint32 getNumSheets() const     { return m_num_sheets; }
+    uint32 getSheetHeight() const   { return m_num_sheets>0 ? m_atlas.height()/m_num_sheets : 0; }
+
+    // GL のリソースは GL backend が最初に使う時に作ります。renderer は同じ context (か共有している context) で使うこと
+    Texture2DArray* getTexture()
+    {
+        if(m_texture==NULL) { m_texture = CreateTexture2DArrayFromImage(m_atlas, m_num_sheets); }
+        return m_texture;
+    }
+
+    Sampler* getSampler()
+    {
+        if(m_sampler==NULL) { m_sampler = new Sampler(SamplerDesc(GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_LINEAR, GL_LINEAR)); }
+        return m_sampler;
+    }
+
+    ShaderProgram* getShader(bool instanced)
+    {
+        const uint32 i = instanced ? 1 : 0;
+        if(m_shaders[i]==NULL) {
+            if(m_ps==NULL) { m_ps = CreatePixelShaderFromString(g_font_pssrc); }
+            m_vs[i] = CreateVertexShaderFromString(instanced ? g_font_instanced_vssrc : g_font_vssrc);
+            m_shaders[i] = new ShaderProgram(ShaderProgramDesc(m_vs[i], m_ps));
+        }
+        return m_shaders[i];
+    }
+
+private:
+    friend class FontRegistry;
+    FontAsset(const FontAsset&);
+    FontAsset& operator=(const FontAsset&);
+
+    static bool loadSheet(Image &dst, IBinaryStream &img_stream)
+    {
+        // alpha だけ読み込む。alpha がない画像であれば red だけ
+        Image::IOConfig conf;
+        conf.setChannel(Image::Channel_AlphaOrRed);
+        return dst.load(img_stream, conf);
+    }
+
+    // シートを縦に積んで m_atlas にする。大きさが違うシートは一番大きいものに合わせ、右と下を 0 で埋めます
+    // uv は uint16 の texel 座標なので、積んだ高さは 65536 までです
+    bool buildAtlas(stl::vector<Image> &sheets)
+    {
+        const uint32 num_sheets = uint32(sheets.size());
+        uint32 w = 0, h = 0;
+        for(uint32 i=0; i<num_sheets; ++i) {
+            w = stl::max<uint32>(w, sheets[i].width());
+            h = stl::max<uint32>(h, sheets[i].height());
+        }
+        if(w==0 || h==0 || w>65536 || h*num_sheets>65536) {
+            istPrint("invalid atlas size: %u x %u x %u sheets\n", w, h, num_sheets);
+            return false;
+        }
+        if(num_sheets==1) {
+            m_atlas.swap(sheets[0]);
+        }
+        else {
+            m_atlas.resize<R_8U>(w, h*num_sheets);
+            ::memset(m_atlas.data(), 0, m_atlas.size());
+            for(uint32 i=0; i<num_sheets; ++i) {
+                const Image &sheet = sheets[i];
+                for(uint32 y=0; y<sheet.height(); ++y) {
+                    ::memcpy(&m_atlas.get<R_8U>(i*h+y, 0), &sheet.get<R_8U>(y, 0), sheet.width());
+                }
+            }
+        }
+        m_num_sheets = num_sheets;
+        if(num_sheets<m_font.getNumSheets()) {
+            istPrint("sheet %u-%u not loaded. glyphs on them are not drawn\n", num_sheets, m_font.getNumSheets()-1);
+        }
+        m_font.setSheetSize(w, h, num_sheets);
+        return true;
+    }
+
+    stl::string m_key;
+    size_t m_ref_count;
+    SFFFont m_font;
+    Image m_atlas;
+    uint32 m_num_sheets;
+    Texture2DArray *m_texture;
+    Sampler *m_sampler;
+    PixelShader *m_ps;
+    VertexShader *m_vs[2];          // [0]: 通常, [1]: instanced
+    ShaderProgram *m_shaders[2];
+};
+
+// FontAsset をパス (ストリームの場合は中身のハッシュ) をキーにして共有します
+// 読み込み (画像のデコードと .sff の読み込み) はロックの外で行うので、別のフォントの作成や release() を止めません
+// 同じキーを読み込み中に acquire() したスレッドは、その結果を待って共有します。失敗していたら自分で読み込み直します
+class FontRegistry
+{
+public:
+    // 失敗したら NULL。使い終わったら release() すること
+    FontAsset* acquire(const char *path_to_sff, const char *path_to_img)
+    {
+        const stl::string key = "path:" + GetCanonicalPath(path_to_sff) + "\n" + GetCanonicalPath(path_to_img);
+        if(FontAsset *a = findOrReserve(key)) { return a; }
+
+        FontAsset *a = new FontAsset();
+        const bool succeeded = a->load(path_to_sff, path_to_img);
+        return publish(key, a, succeeded);
+    }
+
+    FontAsset* acquire(IBinaryStream &sff, IBinaryStream &img)
+    {
+        stl::vector<char> sff_buf, img_buf;
+        ReadAll(sff, sff_buf);
+        ReadAll(img, img_buf);
+        char key[64];
+        sprintf(key, "stream:%016llx:%016llx", HashBytes(sff_buf), HashBytes(img_buf));
+        if(sff_buf.empty() || img_buf.empty()) { return NULL; }
+        if(FontAsset *a = findOrReserve(key)) { return a; }
+
+        IntrusiveMemoryStream sff_ms(&sff_buf[0], sff_buf.size());
+        IntrusiveMemoryStream img_ms(&img_buf[0], img_buf.size());
+        FontAsset *a = new FontAsset();
+        const bool succeeded = a->load(sff_ms, img_ms);
+        return publish(key, a, succeeded);
+    }
+
+    // 既に持っている asset の参照を増やします。release() と対にすること
+    void addRef(FontAsset *a)
+    {
+        ScopedLock lock(m_mutex);
+        ++a->m_ref_count;
+    }
+
+    void release(FontAsset *a)
+    {
+        ScopedLock lock(m_mutex);
+        if(--a->m_ref_count > 0) { return; }
+        m_assets.erase(a->m_key);
+        delete a;
+    }
+
+private:
+    typedef stl::map<stl::string, FontAsset*> AssetMap;
+    typedef stl::set<stl::string> KeySet;
+
+    // 読み込み済みなら参照を増やして返す。他のスレッドが読み込み中なら終わるまで待ち、
+    // どちらでもなければ読み込み中として登録して NULL を返すので、呼んだ側が読み込んで publish() すること
+    FontAsset* findOrReserve(const stl::string &key)
+    {
+        ScopedLock lock(m_mutex);
+        for(;;) {
+            AssetMap::iterator i = m_assets.find(key);
+            if(i!=m_assets.end()) {
+                ++i->second->m_ref_count;
+                return i->second;
+            }
+            if(m_loading.find(key)==m_loading.end()) { break; }
+            m_loaded.wait(m_mutex);
+        }
+        m_loading.insert(key);
+        return NULL;
+    }
+
+    // findOrReserve() で登録した読み込みの結果を登録し、待っているスレッドを起こす。失敗したら a は破棄して NULL
+    FontAsset* publish(const stl::string &key, FontAsset *a, bool succeeded)
+    {
+        if(!succeeded) {
+            delete a;
+            a = NULL;
+        }
+        ScopedLock lock(m_mutex);
+        m_loading.erase(key);
+        if(a) {
+            a->m_key = key;
+            a->m_ref_count = 1;
+            m_assets[key] = a;
+        }
+        m_loaded.signalAll();
+        return a;
+    }
+
+    // 同じファイルを別の書き方で指定しても同じキーになるよう、絶対パスにしておく
+    static stl::string GetCanonicalPath(const char *path)
+    {
+#ifdef istWindows
+        char buf[MAX_PATH];
+        if(::_fullpath(buf, path, MAX_PATH)!=NULL) { return buf; }
+#else // istWindows
+        if(char *p = ::realpath(path, NULL)) {
+            stl::string r = p;
+            ::free(p);
+            return r;
+        }
+#endif // istWindows
+        return path;
+    }
+
+    static void ReadAll(IBinaryStream &st, stl::vector<char> &dst)
+    {
+        st.setReadPos(0, IBinaryStream::Seek_End);
+        dst.resize((size_t)st.getReadPos());
+        st.setReadPos(0);
+        if(!dst.empty()) { st.read(&dst[0], dst.size()); }
+    }
+
+    // FNV-1a
+    static unsigned long long HashBytes(const stl::vector<char> &data)
+    {
+        uint64 h = 14695981039346656037ULL;
+        for(size_t i=0; i<data.size(); ++i) {
+            h = (h ^ uint8(data[i])) * 1099511628211ULL;
+        }
+        return h ^ uint64(data.size());
+    }
+
+    AssetMap m_assets;
+    KeySet m_loading;       // 読み込み中のキー
+    Mutex m_mutex;
+    Condition m_loaded;     // m_loading から消えた時に起こす
+};
+FontRegistry g_font_registry;
+
+// CreateGLSpriteFontAsync() 用。FontRegistry::acquire() (画像のデコードと .sff の読み込み) を別スレッドで行います
+// GL への転送はしないので、結果は renderer の flush() で backend に渡します
+class FontLoadThread : public Thread
+{
+public:
+    FontLoadThread(const char *path_to_sff, const char *path_to_img)
+        : m_path_to_sff(path_to_sff)
+        , m_path_to_img(path_to_img)
+        , m_asset(NULL)
+        , m_done(false)
+    {}
+
+    bool isDone() const
+    {
+        ScopedLock lock(m_mutex);
+        return m_done;
+    }
+
+    // join() した後に。失敗していたら NULL
+    FontAsset* getAsset() const { return m_asset; }
+
+protected:
+    virtual void exec()
+    {
+        FontAsset *a = g_font_registry.acquire(m_path_to_sff.c_str(), m_path_to_img.c_str());
+        ScopedLock lock(m_mutex);
+        m_asset = a;
+        m_done = true;
+    }
+
+private:
+    stl::string m_path_to_sff;
+    stl::string m_path_to_img;
+    FontAsset *m_asset;
+    bool m_done;
+    mutable Mutex m_mutex;
+};
+
+
+// OpenGL 3.3 で描く backend
+class GLFontBackend : public FontBackend
+{
+public:
+    // 非 instanced 時の頂点 (16 byte)。FontQuad の pos を矩形の角の位置にしたもので、残りはそのまま
+    // texel 座標や縁取りの広げ方は instanced 時と同じくシェーダで求めます
+    struct VertexT
+    {
+        int16 pos[2];
+        uint16 uv[2];
+        uint32 color;
+        uint8 size[2];
+        uint16 scale;
+
+        VertexT() {}
+        VertexT(const FontQuad &q, int16 x, int16 y) : color(q.color), scale(q.scale)
+        {
+            pos[0]=x; pos[1]=y; uv[0]=q.uv[0]; uv[1]=q.uv[1]; size[0]=q.size[0]; size[1]=q.size[1];
+        }
+    };
+    struct RenderState
+    {
+        mat4 matrix;
+        vec4 rcp_tex_size;  // xy: 1/シートの大きさ, z: シートの高さ (texel)
+    };
+    // シェーダの BlockStates。静的テキスト毎に 1 つ GPU 上に置きます。drawQuads() の分は原点 0、色 1 のものを使う
+    struct BlockState
+    {
+        vec4 offset;        // xy: 量子化した clip 座標での原点
+        vec4 color;         // 文字の色に掛ける
+    };
+    // シェーダの EffectStates。setEffect() で変わった時だけ書き換えます
+    struct EffectState
+    {
+        vec4 outline_color;
+        vec4 shadow_color;
+        vec4 params;        // x: 縁取りの幅, yz: 影の位置 (画面の座標系)
+        vec4 clip_rect;     // FontEffect::clip_rect
+    };
+
+    // 静的テキストは専用のバッファに置いたままにし、移動/色変更は BlockState の書き換えだけで済ませます
+    class GLStaticBlock : public StaticBlock
+    {
+    public:
+        GLStaticBlock() : num_quads(0), vbo(NULL), va(NULL), ubo(NULL), state_written(false) {}
+        ~GLStaticBlock()
+        {
+            delete va;
+            delete vbo;
+            delete ubo;
+        }
+
+        size_t num_quads;
+        Buffer *vbo;
+        VertexArray *va;
+        Buffer *ubo;
+        BlockState state;       // ubo に書いてある値
+        bool state_written;
+    };
+
+    // StreamBuffer の 1 区画に入る文字数。1 回の drawQuads() でこれを超える分は描画を分けます
+    static const size_t MaxCharsPerDraw = 16384;
+    // glIFR_GPUTimer 用の query の数。結果を待たずに次の flush() に進めるよう、この数だけ使い回します
+    static const uint32 NumTimerQueries = 4;
+
+public:
+    GLFontBackend(int flags)
+        : m_flags(flags)
+        , m_sampler(NULL)
+        , m_texture(NULL)
+        , m_vbo(NULL)
+        , m_va(NULL)
+        , m_ubo(NULL)
+        , m_effect_ubo(NULL)
+        , m_default_block(NULL)
+        , m_shader(NULL)
+        , m_uniform_loc(0)
+        , m_block_loc(0)
+        , m_effect_loc(0)
+        , m_renderstate_dirty(true)
+        , m_effect_dirty(true)
+        , m_stats(NULL)
+        , m_query_pos(0)
+        , m_query_active(false)
+        , m_gpu_ms(-1.0)
+    {
+        for(uint32 i=0; i<NumTimerQueries; ++i) { m_queries[i]=0; m_query_pending[i]=false; }
+    }
+
+    ~GLFontBackend()
+    {
+        delete m_va;
+        delete m_default_block;
+        delete m_effect_ubo;
+        delete m_ubo;
+        delete m_vbo;
+        if(m_queries[0]!=0) { glDeleteQueries(NumTimerQueries, m_queries); }
+    }
+
+    static bool initializeGLEW()
+    {
+        static bool s_glew_initialized = false;
+        if(!s_glew_initialized) {
+            if(glewInit()!=GLEW_OK) { return false; }
+            s_glew_initialized = true;
+        }
+        return true;
+    }
+
+    // テクスチャ、サンプラ、シェーダは asset のものを使う。バッファと query はこの backend 専用です
+    virtual bool initialize(FontAsset &asset)
+    {
+        if(!initializeGLEW()) { return false; }
+        Texture2DArray *texture = asset.getTexture();
+        return texture!=NULL && initialize(texture, asset.getSampler(), asset.getShader(isInstanced()));
+    }
+
+    // テクスチャ等を外から渡す版 (SpriteFontBatch 用)。どれもこの backend より長生きであること
+    // texture は NULL でもよく、その場合は最初の描画までに setTexture() してください
+    bool initialize(Texture2DArray *texture, Sampler *sampler, ShaderProgram *shader)
+    {
+        setTexture(texture);
+        m_sampler = sampler;
+        m_ubo = new Buffer(BufferDesc(GL_UNIFORM_BUFFER, GL_DYNAMIC_DRAW, sizeof(RenderState)));
+        m_effect_ubo = new Buffer(BufferDesc(GL_UNIFORM_BUFFER, GL_DYNAMIC_DRAW, sizeof(EffectState)));
+        {
+            BlockState bs = {vec4(0.0f), vec4(1.0f)};
+            m_default_block = new Buffer(BufferDesc(GL_UNIFORM_BUFFER, GL_STATIC_DRAW, sizeof(BlockState), &bs));
+        }
+        // instanced 時は FontQuad をそのまま 1 インスタンス分の頂点属性として使う
+        const size_t quad_size = isInstanced() ? sizeof(FontQuad) : sizeof(VertexT)*4;
+        m_vbo = new StreamBuffer(GL_ARRAY_BUFFER, quad_size*MaxCharsPerDraw);
+        m_va = new VertexArray();
+        setVertexAttributes(*m_va, *m_vbo, 0);
+        m_shader = shader;
+        m_uniform_loc = m_shader->getUniformBlockIndex("render_states");
+        m_block_loc = m_shader->getUniformBlockIndex("block_states");
+        m_effect_loc = m_shader->getUniformBlockIndex("effect_states");
+        if(isGPUTimerEnabled()) { glGenQueries(NumTimerQueries, m_queries); }
+        return true;
+    }
+
+    virtual void setScreenMatrix(const mat4 &m)
+    {
+        m_renderstate.matrix = m;
+        m_renderstate_dirty = true;
+    }
+
+    void setTexture(Texture2DArray *texture)
+    {
+        m_texture = texture;
+        if(m_texture==NULL) { return; }
+        const uvec3 tex_size = m_texture->getDesc().size;
+        m_renderstate.rcp_tex_size = vec4(vec2(1.0f, 1.0f)/vec2(tex_size.x, tex_size.y), float32(tex_size.y), 0.0f);
+        m_renderstate_dirty = true;
+    }
+
+    virtual void setEffect(const FontEffect &effect)
+    {
+        EffectState es = {effect.outline_color, effect.shadow_color, vec4(effect.outline_width, effect.shadow_offset.x, effect.shadow_offset.y, 0.0f), effect.clip_rect};
+        if(!m_effect_dirty && es.outline_color==m_effectstate.outline_color && es.shadow_color==m_effectstate.shadow_color && es.params==m_effectstate.params && es.clip_rect==m_effectstate.clip_rect) { return; }
+        m_effectstate = es;
+        m_effect_dirty = true;
+    }
+
+    virtual StaticBlock* createStaticBlock(const FontQuad *quads, size_t num_quad)
+    {
+        if(num_quad==0) { return NULL; }
+        GLStaticBlock *block = new GLStaticBlock();
+        block->num_quads = num_quad;
+        size_t bytes = 0;
+        if(isInstanced()) {
+            bytes = sizeof(FontQuad)*num_quad;
+            block->vbo = new Buffer(BufferDesc(GL_ARRAY_BUFFER, GL_STATIC_DRAW, bytes, (void*)quads));
+        }
+        else {
+            stl::vector<VertexT> vertices(num_quad*4);
+            expandQuads(m_renderstate, quads, num_quad, &vertices[0]);
+            bytes = sizeof(VertexT)*vertices.size();
+            block->vbo = new Buffer(BufferDesc(GL_ARRAY_BUFFER, GL_STATIC_DRAW, bytes, &vertices[0]));
+        }
+        if(m_stats) { m_stats->bytes_uploaded += bytes; }
+        block->va = new VertexArray();
+        setVertexAttributes(*block->va, *block->vbo, 0);
+        block->ubo = new Buffer(BufferDesc(GL_UNIFORM_BUFFER, GL_DYNAMIC_DRAW, sizeof(BlockState)));
+        return block;
+    }
+
+    virtual void beginFlush(glIFR_FlushStats &stats)
+    {
+        m_stats = &stats;
+        if(isGPUTimerEnabled()) { beginTimerQuery(); }
+        stats.gpu_ms = m_gpu_ms;
+
+        updateRenderState();
+        m_shader->setUniformBlock(m_uniform_loc, 0, m_ubo->getHandle());
+        m_shader->setUniformBlock(m_effect_loc, 2, m_effect_ubo->getHandle());
+        m_shader->bind();
+        m_sampler->bind(0);
+        m_texture->bind(0);
+    }
+
+    // 位置と色が前回と同じなら転送は発生しません
+    virtual void drawStaticBlock(StaticBlock *b, const vec2 &origin, const vec4 &color)
+    {
+        GLStaticBlock *block = static_cast<GLStaticBlock*>(b);
+        updateRenderState();
+        const vec4 offset = vec4(origin, 0.0f, 0.0f);
+        if(!block->state_written || block->state.offset!=offset || block->state.color!=color) {
+            BlockState bs = {offset, color};
+            MapAndWrite(*block->ubo, &bs, sizeof(bs));
+            block->state = bs;
+            block->state_written = true;
+            ++m_stats->map_count;
+            m_stats->bytes_uploaded += sizeof(bs);
+        }
+        m_shader->setUniformBlock(m_block_loc, 1, block->ubo->getHandle());
+        block->va->bind();
+        draw(block->num_quads);
+    }
+
+    // 1 回の flush で何度呼ばれても StreamBuffer の現在の区画に続けて書くので、区画が空いている間は GPU を待ちません
+    // flush 中に setScreenMatrix() されていれば、ここで uniform を更新してから描きます
+    virtual void drawQuads(const FontQuad *quads, size_t num_quads)
+    {
+        updateRenderState();
+        m_shader->setUniformBlock(m_block_loc, 1, m_default_block->getHandle());
+        size_t drawn_quads = 0;
+        while(drawn_quads<num_quads) {
+            size_t num_quad = stl::min<size_t>(num_quads-drawn_quads, MaxCharsPerDraw);
+            const size_t bytes = isInstanced() ? sizeof(FontQuad)*num_quad : sizeof(VertexT)*4*num_quad;
+            if(isInstanced()) {
+                void *p = m_vbo->map(bytes);
+                ::memcpy(p, &quads[drawn_quads], bytes);
+            }
+            else {
+                expandQuads(m_renderstate, &quads[drawn_quads], num_quad, (VertexT*)m_vbo->map(bytes));
+            }
+            m_vbo->unmap();
+            ++m_stats->chunks;
+            ++m_stats->map_count;
+            m_stats->bytes_uploaded += bytes;
+            // 非 instanced 時は書いた位置を先頭の頂点として描く (4 の倍数なので gl_VertexID&3 の角はずれない)
+            // instanced 時は base instance が GL 3.3 にないので、属性の開始位置を書いた位置に合わせ直す
+            size_t first = 0;
+            if(isInstanced()) {
+                setVertexAttributes(*m_va, *m_vbo, m_vbo->getMapOffset());
+            }
+            else {
+                first = m_vbo->getMapOffset()/sizeof(VertexT);
+            }
+            m_va->bind();
+            draw(num_quad, first);
+            drawn_quads += num_quad;
+        }
+    }
+
+    // fence はこの flush で書いた区画に 1 回だけ置きます
+    virtual void endFlush()
+    {
+        m_vbo->advance();
+        if(m_query_active) {
+            glEndQuery(GL_TIME_ELAPSED);
+            m_query_pending[m_query_pos] = true;
+            m_query_pos = (m_query_pos+1)%NumTimerQueries;
+            m_query_active = false;
+        }
+        m_stats = NULL;
+    }
+
+    // 非 instanced 時に FontQuad を 4 頂点に展開する。右下の角は instanced 用シェーダと同じ式で求めます
+    // 頂点の順は (左上, 左下, 右下, 右上) で、シェーダは gl_VertexID&3 をこの順の角として扱います
+    // GL の状態には触らないので、context なしでも呼べます (bench 用)
+    static void expandQuads(const RenderState &rs, const FontQuad *quads, size_t num_quad, VertexT *vertex)
+    {
+        const vec2 pos_scale = vec2(rs.matrix[0][0], rs.matrix[1][1]) * FontQuadPosScale;
+        for(size_t qi=0; qi<num_quad; ++qi) {
+            const FontQuad &quad = quads[qi];
+            VertexT *v = &vertex[qi*4];
+            const vec2 texel = vec2(quad.size[0], quad.size[1]);
+            const vec2 pos_max = glm::clamp(vec2(quad.pos[0], quad.pos[1]) + texel*glm::detail::toFloat32(quad.scale)*pos_scale,
+                vec2(FontQuadPosMin), vec2(FontQuadPosMax));
+            const int16 x0=quad.pos[0], y0=quad.pos[1], x1=QuantizePos(pos_max.x), y1=QuantizePos(pos_max.y);
+            v[0] = VertexT(quad, x0, y0);
+            v[1] = VertexT(quad, x0, y1);
+            v[2] = VertexT(quad, x1, y1);
+            v[3] = VertexT(quad, x1, y0);
+        }
+    }
+
+private:
+    bool isInstanced() const { return (m_flags & glIFR_Instanced)!=0; }
+    bool isGPUTimerEnabled() const { return (m_flags & glIFR_GPUTimer)!=0; }
+
+    // uniform は変更があった時だけ更新
+    void updateRenderState()
+    {
+        if(m_renderstate_dirty) {
+            MapAndWrite(*m_ubo, &m_renderstate, sizeof(m_renderstate));
+            m_renderstate_dirty = false;
+            ++m_stats->map_count;
+            m_stats->bytes_uploaded += sizeof(m_renderstate);
+        }
+        if(m_effect_dirty) {
+            MapAndWrite(*m_effect_ubo, &m_effectstate, sizeof(m_effectstate));
+            m_effect_dirty = false;
+            ++m_stats->map_count;
+            m_stats->bytes_uploaded += sizeof(m_effectstate);
+        }
+    }
+
+    // 結果が出ている query を古い順に回収してから、空いていれば次の query を始める。GPU を待つことはしません
+    // 全部使用中 (GPU が NumTimerQueries 回分以上遅れている) の時はこの flush() は計測しない
+    void beginTimerQuery()
+    {
+        for(uint32 i=0; i<NumTimerQueries; ++i) {
+            const uint32 qi = (m_query_pos+i)%NumTimerQueries;
+            if(!m_query_pending[qi]) { continue; }
+            GLint available = 0;
+            glGetQueryObjectiv(m_queries[qi], GL_QUERY_RESULT_AVAILABLE, &available);
+            if(!available) { continue; }
+            GLuint64 ns = 0;
+            glGetQueryObjectui64v(m_queries[qi], GL_QUERY_RESULT, &ns);
+            m_gpu_ms = double(ns)/1000000.0;
+            m_query_pending[qi] = false;
+        }
+        if(!m_query_pending[m_query_pos]) {
+            glBeginQuery(GL_TIME_ELAPSED, m_queries[m_query_pos]);
+            m_query_active = true;
+        }
+    }
+
+    // FontQuad と VertexT は同じ並びなので、違うのは instanced かどうかだけ
+    void setVertexAttributes(VertexArray &va, Buffer &vb, size_t base_offset)
+    {
+        const GLuint divisor = isInstanced() ? 1 : 0;
+        const VertexDesc descs[] = {
+            {0, GL_SHORT,           2,  0, false, divisor},
+            {1, GL_UNSIGNED_SHORT,  2,  4, false, divisor},
+            {2, GL_UNSIGNED_BYTE,   4,  8, true,  divisor},
+            {3, GL_UNSIGNED_BYTE,   2, 12, false, divisor},
+            {4, GL_HALF_FLOAT,      1, 14, false, divisor},
+        };
+        va.setAttributes(vb, sizeof(FontQuad), descs, _countof(descs), base_offset);
+    }
+
+    // first は非 instanced 時の先頭の頂点
+    void draw(size_t num_quad, size_t first=0)
+    {
+        ++m_stats->draw_calls;
+        m_stats->glyphs_drawn += num_quad;
+        if(isInstanced()) {
+            glDrawArraysInstanced(GL_TRIANGLE_STRIP, 0, 4, num_quad);
+        }
+        else {
+            glDrawArrays(GL_QUADS, first, num_quad*4);
+        }
+    }
+
+    int m_flags;
+    Sampler *m_sampler;         // ここまで 3 つは FontAsset のもの
+    Texture2DArray *m_texture;
+    StreamBuffer *m_vbo;
+    VertexArray *m_va;
+    Buffer *m_ubo;
+    Buffer *m_effect_ubo;
+    Buffer *m_default_block;
+    ShaderProgram *m_shader;
+    GLint m_uniform_loc;
+    GLint m_block_loc;
+    GLint m_effect_loc;
+    RenderState m_renderstate;
+    bool m_renderstate_dirty;
+    EffectState m_effectstate;
+    bool m_effect_dirty;
+    glIFR_FlushStats *m_stats;  // beginFlush() から endFlush() の間だけ有効
+    GLuint m_queries[NumTimerQueries];
+    bool m_query_pending[NumTimerQueries];
+    uint32 m_query_pos;
+    bool m_query_active;
+    double m_gpu_ms;
+};
+
+
+// 何も描かない backend。GL context なしでレイアウトとバッチ化だけを動かしたい時 (計測やツール) 用
+class NullFontBackend : public FontBackend
+{
+public:
+    virtual bool initialize(FontAsset &asset)   { return true; }
+    virtual void setScreenMatrix(const mat4 &m) {}
+    virtual StaticBlock* createStaticBlock(const FontQuad *quads, size_t num_quad) { return num_quad>0 ? new StaticBlock() : NULL; }
+    virtual void beginFlush(glIFR_FlushStats &stats) {}
+    virtual void drawStaticBlock(StaticBlock *block, const vec2 &origin, const vec4 &color) {}
+    virtual void drawQuads(const FontQuad *quads, size_t num_quad) {}
+    virtual void endFlush()                     {}
+};
+
+
+// CPU で RGBA8 の Image に描く backend。位置とサイズは instanced 用シェーダと同じ式で求め、テクスチャは GL_LINEAR 相当で補間します
+// 色は glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA) 相当で合成。alpha は over で積むので、透明な画像に描いても文字の形が残ります
+// 描画先を BandHeight 行毎の帯に分けて文字を振り分け、帯単位でスレッドに分けて描きます。帯の中では追加した順に重ねるので、結果はスレッド数によらず同じです
+// スレッドは作った時に立てておき、flush() の間は待たせておきます
+class SoftwareFontBackend : public FontBackend
+{
+public:
+    static const int32 BandHeight = 32;
+    // 文字数がこれ未満ならスレッドを起こさずにその場で描く
+    static const size_t MinQuadsForThreading = 256;
+
+    // 静的テキストは FontQuad のまま持っておく
+    class SoftwareStaticBlock : public StaticBlock
+    {
+    public:
+        stl::vector<FontQuad> quads;
+    };
+
+    SoftwareFontBackend(uint32 width, uint32 height) : m_atlas(NULL), m_sheet_height(0), m_pos_scale(1.0f), m_stats(NULL), m_work_generation(0), m_work_pending(0), m_quit(false)
+    {
+        m_canvas.resize<RGBA_8U>(width, height);
+        m_bands.resize((height+BandHeight-1)/BandHeight);
+        // 帯 i はスレッド i%(m_workers.size()+1) が受け持つ。0 番は flush() したスレッド
+        const size_t num_threads = stl::min<size_t>(GetNumProcessors(), m_bands.size());
+        for(size_t i=1; i<num_threads; ++i) {
+            m_workers.push_back(new BandWorker(this, i));
+            m_workers.back()->run();
+        }
+    }
+
+    ~SoftwareFontBackend()
+    {
+        {
+            ScopedLock lock(m_work_mutex);
+            m_quit = true;
+            m_work_cond.signalAll();
+        }
+        for(size_t i=0; i<m_workers.size(); ++i) {
+            m_workers[i]->join();
+            delete m_workers[i];
+        }
+    }
+
+    // atlas (R8U) は asset のものを読むだけです
+    virtual bool initialize(FontAsset &asset)
+    {
+        m_atlas = &asset.getAtlas();
+        m_sheet_height = int32(asset.getSheetHeight());
+        return true;
+    }
+
+    virtual void setScreenMatrix(const mat4 &m) { m_pos_scale = vec2(m[0][0], m[1][1])*FontQuadPosScale; }
+    virtual void setEffect(const FontEffect &effect) { m_effect = effect; }
+
+    virtual StaticBlock* createStaticBlock(const FontQuad *quads, size_t num_quad)
+    {
+        if(num_quad==0) { return NULL; }
+        SoftwareStaticBlock *block = new SoftwareStaticBlock();
+        block->quads.assign(quads, quads+num_quad);
+        return block;
+    }
+
+    // draw call は drawStaticBlock()/drawQuads() の回数、chunk は描いた帯の数として数えます
+    virtual void beginFlush(glIFR_FlushStats &stats) { m_stats=&stats; }
+
+    virtual void drawStaticBlock(StaticBlock *b, const vec2 &origin, const vec4 &color)
+    {
+        const SoftwareStaticBlock *block = static_cast<const SoftwareStaticBlock*>(b);
+        addQuads(&block->quads[0], block->quads.size(), origin, color);
+        ++m_stats->draw_calls;
+    }
+
+    virtual void drawQuads(const FontQuad *quads, size_t num_quad)
+    {
+        addQuads(quads, num_quad, vec2(0.0f), vec4(1.0f));
+        ++m_stats->draw_calls;
+    }
+
+    virtual void endFlush()
+    {
+        m_stats->glyphs_drawn += m_quads.size();
+        for(size_t i=0; i<m_bands.size(); ++i) {
+            if(!m_bands[i].empty()) { ++m_stats->chunks; }
+        }
+        execute();
+        m_stats = NULL;
+    }
+    virtual Image* getCanvas() { return &m_canvas; }
+
+private:
+
+    // offset は量子化した clip 座標での原点 (BlockState::offset と同じ)、color は文字の色に掛けます
+    // ここでは帯に振り分けるだけで、実際に描くのは endFlush() です
+    void addQuads(const FontQuad *quads, size_t num_quad, const vec2 &offset, const vec4 &color)
+    {
+        const vec2 canvas_size = vec2(float32(m_canvas.width()), float32(m_canvas.height()));
+        if(canvas_size.x==0.0f || canvas_size.y==0.0f || m_sheet_height==0) { return; }
+        // 量子化した clip 座標 -> pixel 座標。上の行が y=0
+        const vec2 to_pixel_scale = vec2(0.5f, -0.5f)*canvas_size/FontQuadPosScale;
+        const vec2 to_pixel_offset = canvas_size*0.5f;
+        const bool has_effect = m_effect.hasOutline() || m_effect.hasShadow();
+        if(has_effect && (m_effects.empty() || m_effects.back()!=m_effect)) { m_effects.push_back(m_effect); }
+
+        for(size_t qi=0; qi<num_quad; ++qi) {
+            const FontQuad &quad = quads[qi];
+            const vec2 texel = vec2(quad.size[0], quad.size[1]);
+            const float32 scale = glm::detail::toFloat32(quad.scale);
+            const vec2 q0 = vec2(quad.pos[0], quad.pos[1]) + offset;
+            const vec2 q1 = q0 + texel*scale*m_pos_scale;
+            const vec2 p0 = q0*to_pixel_scale + to_pixel_offset;
+            const vec2 p1 = q1*to_pixel_scale + to_pixel_offset;
+            // 縁取りと影の分はシェーダと同じく texel 単位で広げる
+            RasterQuad rq;
+            vec2 e0 = p0, e1 = p1;
+            rq.effect = -1;
+            if(has_effect) {
+                rq.effect = int32(m_effects.size())-1;
+                rq.radius = m_effect.outline_width/scale;
+                rq.shadow_s = m_effect.shadow_offset.x/scale;
+                rq.shadow_t = m_effect.shadow_offset.y/scale;
+                const vec2 shadow = vec2(rq.shadow_s, rq.shadow_t);
+                const vec2 pad_min = vec2(rq.radius) + glm::max(-shadow, vec2(0.0f));
+                const vec2 pad_max = vec2(rq.radius) + glm::max(shadow, vec2(0.0f));
+                e0 = (q0 - pad_min*scale*m_pos_scale)*to_pixel_scale + to_pixel_offset;
+                e1 = (q1 + pad_max*scale*m_pos_scale)*to_pixel_scale + to_pixel_offset;
+            }
+            // 中心が矩形に入っている pixel を塗る。縁取り/影のある文字は clip_rect の外も塗らない
+            vec2 pmin = glm::min(e0, e1), pmax = glm::max(e0, e1);
+            if(has_effect) {
+                const vec2 c0 = vec2(m_effect.clip_rect.x, m_effect.clip_rect.y)*to_pixel_scale + to_pixel_offset;
+                const vec2 c1 = vec2(m_effect.clip_rect.z, m_effect.clip_rect.w)*to_pixel_scale + to_pixel_offset;
+                pmin = glm::max(pmin, glm::min(c0, c1));
+                pmax = glm::min(pmax, glm::max(c0, c1));
+            }
+            rq.left     = stl::max<int32>(int32(ceil(pmin.x-0.5f)), 0);
+            rq.top      = stl::max<int32>(int32(ceil(pmin.y-0.5f)), 0);
+            rq.right    = stl::min<int32>(int32(ceil(pmax.x-0.5f)), int32(canvas_size.x));
+            rq.bottom   = stl::min<int32>(int32(ceil(pmax.y-0.5f)), int32(canvas_size.y));
+            if(rq.left>=rq.right || rq.top>=rq.bottom) { continue; }
+            rq.x0 = p0.x;
+            rq.y0 = p0.y;
+            rq.sheet_top = int32(quad.uv[1])/m_sheet_height*m_sheet_height;
+            rq.s0 = float32(quad.uv[0]);
+            rq.t0 = float32(int32(quad.uv[1])-rq.sheet_top);
+            rq.s1 = rq.s0+texel.x;
+            rq.t1 = rq.t0+texel.y;
+            rq.ds = texel.x/(p1.x-p0.x);
+            rq.dt = texel.y/(p1.y-p0.y);
+            const vec4 c = glm::clamp(vec4(
+                float32((quad.color    )&0xff), float32((quad.color>> 8)&0xff),
+                float32((quad.color>>16)&0xff), float32((quad.color>>24)&0xff))*color + 0.5f, vec4(0.0f), vec4(255.0f));
+            for(int32 i=0; i<4; ++i) { rq.color[i]=uint8(c[i]); }
+
+            const uint32 index = uint32(m_quads.size());
+            m_quads.push_back(rq);
+            for(int32 b=rq.top/BandHeight; b<=(rq.bottom-1)/BandHeight; ++b) { m_bands[b].push_back(index); }
+        }
+    }
+
+    // addQuads() された文字を描いて空にします
+    void execute()
+    {
+        if(m_quads.empty()) { return; }
+        if(m_quads.size()<MinQuadsForThreading || m_workers.empty()) {
+            drawBands(0, 1);
+        }
+        else {
+            {
+                ScopedLock lock(m_work_mutex);
+                m_work_pending = m_workers.size();
+                ++m_work_generation;
+                m_work_cond.signalAll();
+            }
+            drawBands(0, m_workers.size()+1);
+            ScopedLock lock(m_work_mutex);
+            while(m_work_pending>0) { m_done_cond.wait(m_work_mutex); }
+        }
+        m_quads.clear();
+        m_effects.clear();
+        for(size_t i=0; i<m_bands.size(); ++i) { m_bands[i].clear(); }
+    }
+
+    struct RasterQuad
+    {
+        float32 x0, y0;     // 左上の pixel 座標
+        float32 s0, t0;     // x0,y0 でのシート上の位置 (texel)
+        float32 s1, t1;     // 文字の右下のシート上の位置 (texel)。縁取りと影はこの矩形の外を 0 として扱う
+        float32 ds, dt;     // 1 pixel 進んだ時のテクスチャ上の移動量
+        int32 left, top, right, bottom; // 塗る範囲。right, bottom は含まない
+        int32 sheet_top;    // atlas 上のシートの先頭行。補間はシート内で端を延ばします (GL_CLAMP_TO_EDGE 相当)
+        uint8 color[4];
+        int32 effect;       // m_effects の添字。縁取りも影もなければ -1
+        float32 radius;     // 以下は effect>=0 の時だけ。縁取りの幅と影の位置 (texel)
+        float32 shadow_s, shadow_t;
+    };
+
+    class BandWorker : public Thread
+    {
+    public:
+        BandWorker(SoftwareFontBackend *r, size_t first) : m_rasterizer(r), m_first(first) {}
+    protected:
+        virtual void exec() { m_rasterizer->workerLoop(m_first); }
+    private:
+        SoftwareFontBackend *m_rasterizer;
+        size_t m_first;
+    };
+
+    // execute() が m_work_generation を進める度に自分の受け持ちの帯を描く。m_quit で抜けます
+    void workerLoop(size_t first)
+    {
+        uint32 generation = 0;
+        for(;;) {
+            {
+                ScopedLock lock(m_work_mutex);
+                while(!m_quit && m_work_generation==generation) { m_work_cond.wait(m_work_mutex); }
+                if(m_quit) { return; }
+                generation = m_work_generation;
+            }
+            drawBands(first, m_workers.size()+1);
+            ScopedLock lock(m_work_mutex);
+            if(--m_work_pending==0) { m_done_cond.signalAll(); }
+        }
+    }
+
+    void drawBands(size_t first, size_t step)
+    {
+        for(size_t b=first; b<m_bands.size(); b+=step) {
+            const stl::vector<uint32> &band = m_bands[b];
+            const int32 band_top = int32(b)*BandHeight;
+            const int32 band_bottom = band_top+BandHeight;
+            for(size_t i=0; i<band.size(); ++i) {
+                const RasterQuad &rq = m_quads[band[i]];
+                const int32 y_end = stl::min<int32>(rq.bottom, band_bottom);
+                for(int32 y=stl::max<int32>(rq.top, band_top); y<y_end; ++y) {
+                    if(rq.effect<0) { drawRow(rq, y); }
+                    else            { drawRowWithEffect(rq, y); }
+                }
+            }
+        }
+    }
+
+    // rq の y 行目を描く。coverage を MaxSpan 個ずつ求めてはまとめて合成します
+    void drawRow(const RasterQuad &rq, int32 y)
+    {
+        static const int32 MaxSpan = 64;
+        const int32 aw = int32(m_atlas->width()), ah = m_sheet_height;
+        const uint8 *atlas = (const uint8*)m_atlas->data() + aw*rq.sheet_top;
+
+        // 縦方向の補間は行で共通
+        const float32 t = rq.t0 + (float32(y)+0.5f-rq.y0)*rq.dt - 0.5f;
+        const float32 ty = floor(t);
+        const int32 fy = int32((t-ty)*256.0f);
+        const uint8 *row0 = atlas + aw*glm::clamp(int32(ty), 0, ah-1);
+        const uint8 *row1 = atlas + aw*glm::clamp(int32(ty)+1, 0, ah-1);
+
+        uint8 *dst = (uint8*)&m_canvas.get<RGBA_8U>(y, rq.left);
+        uint8 cov[MaxSpan];
+        for(int32 x=rq.left; x<rq.right; ) {
+            const int32 n = stl::min<int32>(rq.right-x, MaxSpan);
+            for(int32 i=0; i<n; ++i) {
+                const float32 s = rq.s0 + (float32(x+i)+0.5f-rq.x0)*rq.ds - 0.5f;
+                const float32 sx = floor(s);
+                const int32 fx = int32((s-sx)*256.0f);
+                const int32 c0 = glm::clamp(int32(sx), 0, aw-1);
+                const int32 c1 = glm::clamp(int32(sx)+1, 0, aw-1);
+                const int32 top = row0[c0]*(256-fx) + row0[c1]*fx;
+                const int32 bottom = row1[c0]*(256-fx) + row1[c1]*fx;
+                cov[i] = uint8((top*(256-fy) + bottom*fy + 32768)>>16);
+            }
+            blendSpan(dst, cov, n, rq.color);
+            dst += n*4;
+            x += n;
+        }
+    }
+
+    // シート上の (s,t) での文字の濃さ (0-1)。文字の矩形の外は 0 で、中は drawRow() と同じく補間します
+    float32 sampleCoverage(const RasterQuad &rq, float32 s, float32 t) const
+    {
+        if(s<rq.s0 || s>rq.s1 || t<rq.t0 || t>rq.t1) { return 0.0f; }
+        const int32 aw = int32(m_atlas->width()), ah = m_sheet_height;
+        const uint8 *atlas = (const uint8*)m_atlas->data() + aw*rq.sheet_top;
+        s -= 0.5f;
+        t -= 0.5f;
+        const float32 sx = floor(s), ty = floor(t);
+        const float32 fx = s-sx, fy = t-ty;
+        const int32 c0 = glm::clamp(int32(sx), 0, aw-1), c1 = glm::clamp(int32(sx)+1, 0, aw-1);
+        const uint8 *row0 = atlas + aw*glm::clamp(int32(ty), 0, ah-1);
+        const uint8 *row1 = atlas + aw*glm::clamp(int32(ty)+1, 0, ah-1);
+        const float32 top = float32(row0[c0])*(1.0f-fx) + float32(row0[c1])*fx;
+        const float32 bottom = float32(row1[c0])*(1.0f-fx) + float32(row1[c1])*fx;
+        return (top*(1.0f-fy) + bottom*fy)/255.0f;
+    }
+
+    // (s,t) と、その周り radius の 8 点 (2 texel より太ければ内側にもう 8 点) の最大値。g_font_pssrc の dilate() と同じです
+    float32 sampleDilated(const RasterQuad &rq, float32 s, float32 t, float32 radius) const
+    {
+        static const float32 dirs[8][2] = {
+            { 1.0f, 0.0f}, { 0.7071f, 0.7071f}, {0.0f,  1.0f}, {-0.7071f,  0.7071f},
+            {-1.0f, 0.0f}, {-0.7071f,-0.7071f}, {0.0f, -1.0f}, { 0.7071f, -0.7071f},
+        };
+        float32 a = sampleCoverage(rq, s, t);
+        for(int32 i=0; i<8; ++i) { a = stl::max<float32>(a, sampleCoverage(rq, s+dirs[i][0]*radius, t+dirs[i][1]*radius)); }
+        if(radius>2.0f) {
+            const float32 r = radius*0.5f;
+            for(int32 i=0; i<8; ++i) { a = stl::max<float32>(a, sampleCoverage(rq, s+dirs[i][0]*r, t+dirs[i][1]*r)); }
+        }
+        return a;
+    }
+
+    // 縁取りか影のある rq の y 行目を描く。pixel 毎に色が変わるので 1 pixel ずつ合成します
+    void drawRowWithEffect(const RasterQuad &rq, int32 y)
+    {
+        const FontEffect &effect = m_effects[rq.effect];
+        const vec4 fill = vec4(rq.color[0], rq.color[1], rq.color[2], rq.color[3])/255.0f;
+        const vec4 outline = effect.outline_color*vec4(1.0f, 1.0f, 1.0f, fill.a);
+        const vec4 shadow = effect.shadow_color*vec4(1.0f, 1.0f, 1.0f, fill.a);
+        const float32 t = rq.t0 + (float32(y)+0.5f-rq.y0)*rq.dt;
+        uint8 *dst = (uint8*)&m_canvas.get<RGBA_8U>(y, rq.left);
+        for(int32 x=rq.left; x<rq.right; ++x, dst+=4) {
+            const float32 s = rq.s0 + (float32(x)+0.5f-rq.x0)*rq.ds;
+            // 乗算済みの色で、塗り、縁取り、影の順に下に重ねる
+            vec4 c = vec4(fill.r, fill.g, fill.b, 1.0f) * (fill.a*sampleCoverage(rq, s, t));
+            if(effect.hasOutline()) {
+                c += vec4(outline.r, outline.g, outline.b, 1.0f) * (outline.a*sampleDilated(rq, s, t, rq.radius)*(1.0f-c.a));
+            }
+            if(effect.hasShadow()) {
+                const float32 ss = s-rq.shadow_s, st = t-rq.shadow_t;
+                const float32 a = effect.hasOutline() ? sampleDilated(rq, ss, st, rq.radius) : sampleCoverage(rq, ss, st);
+                c += vec4(shadow.r, shadow.g, shadow.b, 1.0f) * (shadow.a*a*(1.0f-c.a));
+            }
+            const uint32 a = uint32(glm::clamp(c.a, 0.0f, 1.0f)*255.0f + 0.5f);
+            if(a==0) { continue; }
+            const vec4 rgb = glm::clamp(c/c.a, vec4(0.0f), vec4(1.0f))*255.0f + 0.5f;
+            const uint32 src[4] = {uint32(rgb.r), uint32(rgb.g), uint32(rgb.b), 255};
+            for(int32 ci=0; ci<4; ++ci) { dst[ci] = uint8(Div255(dst[ci]*(255-a) + src[ci]*a)); }
+        }
+    }
+
+    // x/255 を丸めて求める。x は 255*255+255 以下
+    static uint32 Div255(uint32 x) { x+=128; return (x+(x>>8))>>8; }
+
+    // dst = dst*(1-a) + (r,g,b,1)*a。a は coverage × color.a
+    static void blendSpan(uint8 *dst, const uint8 *cov, int32 n, const uint8 *color)
+    {
+        int32 i = 0;
+#ifdef __ist_with_SSE__
+        static const bool s_sse2 = HasCPUFeature(CPU_SSE2);
+        if(s_sse2) {
+            const __m128i zero = _mm_setzero_si128();
+            const __m128i c255 = _mm_set1_epi16(255);
+            const __m128i c128 = _mm_set1_epi16(128);
+            const __m128i ca = _mm_set1_epi16(color[3]);
+            const __m128i src = _mm_set_epi16(255, color[2], color[1], color[0], 255, color[2], color[1], color[0]);
+            for(; i+4<=n; i+=4) {
+                uint32 c4;
+                ::memcpy(&c4, cov+i, 4);
+                if(c4==0) { continue; }
+                // 4 pixel 分の alpha を求めて、各 pixel の 4 channel に広げる
+                __m128i a = _mm_mullo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(int(c4)), zero), ca);
+                a = _mm_add_epi16(a, c128);
+                a = _mm_srli_epi16(_mm_add_epi16(a, _mm_srli_epi16(a, 8)), 8);
+                a = _mm_unpacklo_epi16(a, a);
+                const __m128i a01 = _mm_unpacklo_epi32(a, a);
+                const __m128i a23 = _mm_unpackhi_epi32(a, a);
+
+                __m128i d = _mm_loadu_si128((const __m128i*)(dst+i*4));
+                __m128i d01 = _mm_unpacklo_epi8(d, zero);
+                __m128i d23 = _mm_unpackhi_epi8(d, zero);
+                d01 = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(d01, _mm_sub_epi16(c255, a01)), _mm_mullo_epi16(src, a01)), c128);
+                d23 = _mm_add_epi16(_mm_add_epi16(_mm_mullo_epi16(d23, _mm_sub_epi16(c255, a23)), _mm_mullo_epi16(src, a23)), c128);
+                d01 = _mm_srli_epi16(_mm_add_epi16(d01, _mm_srli_epi16(d01, 8)), 8);
+                d23 = _mm_srli_epi16(_mm_add_epi16(d23, _mm_srli_epi16(d23, 8)), 8);
+                _mm_storeu_si128((__m128i*)(dst+i*4), _mm_packus_epi16(d01, d23));
+            }
+        }
+#endif // __ist_with_SSE__
+        const uint32 src[4] = {color[0], color[1], color[2], 255};
+        for(; i<n; ++i) {
+            const uint32 a = Div255(cov[i]*color[3]);
+            if(a==0) { continue; }
+            uint8 *d = dst+i*4;
+            for(int32 c=0; c<4; ++c) { d[c] = uint8(Div255(d[c]*(255-a) + src[c]*a)); }
+        }
+    }
+
+    const Image *m_atlas;
+    int32 m_sheet_height;
+    Image m_canvas;
+    vec2 m_pos_scale;
+    FontEffect m_effect;
+    stl::vector<FontEffect> m_effects;  // この flush() で使われた縁取り/影の設定
+    glIFR_FlushStats *m_stats;  // beginFlush() から endFlush() の間だけ有効
+    stl::vector<RasterQuad> m_quads;
+    stl::vector<stl::vector<uint32> > m_bands;  // 帯毎の、その帯にかかる m_quads の添字。追加した順
+    stl::vector<BandWorker*> m_workers;
+    Mutex m_work_mutex;         // 以下の 3 つを守る
+    Condition m_work_cond;      // m_work_generation が進んだか m_quit が立った時に起こす
+    Condition m_done_cond;      // m_work_pending が 0 になった時に起こす
+    uint32 m_work_generation;
+    size_t m_work_pending;      // 受け持ちを描き終えていない worker の数
+    bool m_quit;
+};
+
+
+// glIFontBatch の実装。複数のフォントの renderer が flush() で積んだ文字を、1 つのストリームにまとめて描きます
+// 各フォントのシートを 1 つの GL_TEXTURE_2D_ARRAY のレイヤーとして並べ、描く時に uv をそのレイヤーを指すように付け替える
+// layer 順に並べ替えて描き (同じ layer の中は積んだ順)、行列や縁取り/影が変わる所で draw call を分けます。描画自体は GLFontBackend に任せます
+class SpriteFontBatch : public glIFontBatch
+{
+public:
+    // getFlushStats() で返せる数
+    static const size_t FlushStatsHistory = 64;
+
+    // このバッチに文字を積むフォント。renderer が全部なくなっても、積んだ文字を描き終わるまでは残しておきます
+    struct FontSlot
+    {
+        FontAsset *asset;       // FontRegistry から借りているもの
+        uint32 base_layer;      // バッチのテクスチャでのシート 0 のレイヤー
+        size_t ref_count;       // この slot を使っている renderer の数
+
+        FontSlot() : asset(NULL), base_layer(0), ref_count(0) {}
+    };
+
+    SpriteFontBatch(int flags)
+        : m_flags(flags)
+        , m_backend(flags)
+        , m_texture(NULL)
+        , m_sampler(NULL)
+        , m_vs(NULL)
+        , m_ps(NULL)
+        , m_shader(NULL)
+        , m_num_layers(0)
+        , m_layout_dirty(false)
+        , m_peak_quad_capacity(0)
+        , m_num_flush_stats(0)
+    {}
+
+    // renderer は全て先に破棄されていること
+    ~SpriteFontBatch()
+    {
+        m_queued.clear();
+        m_segments.clear();
+        reclaimSlots();
+        delete m_shader;
+        delete m_vs;
+        delete m_ps;
+        delete m_sampler;
+        delete m_texture;
+    }
+
+    bool initialize()
+    {
+        if(!GLFontBackend::initializeGLEW()) { return false; }
+        m_sampler = new Sampler(SamplerDesc(GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_CLAMP_TO_EDGE, GL_LINEAR, GL_LINEAR));
+        m_ps = CreatePixelShaderFromString(g_font_pssrc);
+        m_vs = CreateVertexShaderFromString((m_flags & glIFR_Instanced)!=0 ? g_font_instanced_vssrc : g_font_vssrc);
+        m_shader = new ShaderProgram(ShaderProgramDesc(m_vs, m_ps));
+        return m_backend.initialize(NULL, m_sampler, m_shader);
+    }
+
+    virtual void release() { delete this; }
+
+    // 定義は CreateSpriteFont() の後
+    virtual glIFontRenderer* createFont(const char *path_to_sff, const char *path_to_image);
+
+    virtual size_t getFlushStats(glIFR_FlushStats *out, size_t max_count) const
+    {
+        const size_t n = stl::min<size_t>(max_count, stl::min<size_t>(m_num_flush_stats, FlushStatsHistory));
+        for(size_t i=0; i<n; ++i) {
+            out[i] = m_flush_stats[(m_num_flush_stats-1-i)%FlushStatsHistory];
+        }
+        return n;
+    }
+
+    virtual void flush()
+    {
+        if(m_queued.empty()) {
+            reclaimSlots();
+            return;
+        }
+        const uint64 flush_begin = GetTimeNS();
+        glIFR_FlushStats stats;
+        ::memset(&stats, 0, sizeof(stats));
+        stats.gpu_ms = -1.0;
+        stats.glyphs_submitted = m_queued.size();
+
+        if(m_layout_dirty) {
+            Image atlas;
+            buildAtlas(atlas);
+            delete m_texture;
+            m_texture = CreateTexture2DArrayFromImage(atlas, m_num_layers);
+            m_backend.setTexture(m_texture);
+            stats.bytes_uploaded += atlas.size();
+        }
+        sortSegments();
+        mergeQueued();
+        m_peak_quad_capacity = stl::max<size_t>(m_peak_quad_capacity, m_merged.capacity());
+        stats.peak_quad_capacity = m_peak_quad_capacity;
+
+        // 並べ替えた後に行列と縁取り/影が同じで続いている segment は、m_merged でも続いているのでまとめて 1 回の drawQuads() にする
+        // 同じ layer の中で行列や縁取り/影が変わる所は、積んだ順のまま draw call を分けます
+        m_backend.beginFlush(stats);
+        size_t pos = 0;
+        for(size_t i=0; i<m_segments.size(); ) {
+            const Segment &first = m_segments[m_order[i]];
+            size_t num = 0;
+            for(; i<m_segments.size(); ++i) {
+                const Segment &seg = m_segments[m_order[i]];
+                if(seg.matrix!=first.matrix || seg.state.effect!=first.state.effect) { break; }
+                num += seg.num;
+            }
+            m_backend.setScreenMatrix(first.matrix);
+            m_backend.setEffect(first.state.effect);
+            m_backend.drawQuads(&m_merged[pos], num);
+            pos += num;
+        }
+        m_backend.endFlush();
+        m_queued.clear();
+        m_segments.clear();
+        reclaimSlots();
+
+        stats.flush_ms = double(GetTimeNS()-flush_begin)/1000000.0;
+        m_flush_stats[m_num_flush_stats%FlushStatsHistory] = stats;
+        ++m_num_flush_stats;
+    }
+
+    // 以下は BatchFontBackend から呼ばれます
+
+    // 同じ asset は同じ slot を使います。積んだ高さが uv の範囲 (65536) を超える時は NULL
+    FontSlot* addFont(FontAsset &asset)
+    {
+        for(size_t i=0; i<m_slots.size(); ++i) {
+            if(m_slots[i]->asset==&asset) {
+                ++m_slots[i]->ref_count;
+                return m_slots[i];
+            }
+        }
+        uvec2 size = uvec2(asset.getAtlas().width(), asset.getSheetHeight());
+        uint32 num_layers = asset.getNumSheets();
+        for(size_t i=0; i<m_slots.size(); ++i) {
+            const FontAsset &a = *m_slots[i]->asset;
+            size = glm::max(size, uvec2(a.getAtlas().width(), a.getSheetHeight()));
+            num_layers += a.getNumSheets();
+        }
+        if(size.x>65536 || size.y*num_layers>65536) {
+            istPrint("too many sheets for a batch: %u x %u x %u\n", size.x, size.y, num_layers);
+            return NULL;
+        }
+        g_font_registry.addRef(&asset);
+        FontSlot *slot = new FontSlot();
+        slot->asset = &asset;
+        slot->ref_count = 1;
+        m_slots.push_back(slot);
+        m_layout_dirty = true;
+        return slot;
+    }
+
+    // 実際に外すのは積んである文字を描き終わった後
+    void removeFont(FontSlot *slot)
+    {
+        --slot->ref_count;
+    }
+
+    // quads は slot のフォントの uv のまま積んでおき、flush() で付け替えます
+    // origin, color は静的テキスト用で、FontBackend::drawStaticBlock() と同じ意味です
+    void submit(FontSlot *slot, const mat4 &matrix, const RunState &state, const FontQuad *quads, size_t num_quad, const vec2 &origin, const vec4 &color)
+    {
+        if(num_quad==0 || glm::abs(origin.x)>65536.0f || glm::abs(origin.y)>65536.0f) { return; }
+        if(m_segments.empty() || m_segments.back().slot!=slot || m_segments.back().matrix!=matrix || m_segments.back().state!=state) {
+            Segment seg = {slot, matrix, state, m_queued.size(), 0};
+            m_segments.push_back(seg);
+        }
+        const size_t first = m_queued.size();
+        if(origin==vec2(0.0f) && color==vec4(1.0f)) {
+            m_queued.insert(m_queued.end(), quads, quads+num_quad);
+        }
+        else {
+            // 静的テキストは CPU で位置と色を適用する。int16 に収まらなくなる文字は捨てます
+            const int32 ox = int32(origin.x), oy = int32(origin.y);
+            for(size_t i=0; i<num_quad; ++i) {
+                const FontQuad &src = quads[i];
+                const int32 x = src.pos[0]+ox, y = src.pos[1]+oy;
+                if(x<FontQuadPosMin || x>FontQuadPosMax || y<FontQuadPosMin || y>FontQuadPosMax) { continue; }
+                FontQuad q = src;
+                q.pos[0] = int16(x);
+                q.pos[1] = int16(y);
+                q.color = PackRGBA8(vec4(
+                    float32((src.color    )&0xff), float32((src.color>> 8)&0xff),
+                    float32((src.color>>16)&0xff), float32((src.color>>24)&0xff))/255.0f*color);
+                m_queued.push_back(q);
+            }
+        }
+        m_segments.back().num += m_queued.size()-first;
+        if(m_segments.back().num==0) { m_segments.pop_back(); }
+    }
+
+private:
+    struct Segment
+    {
+        FontSlot *slot;
+        mat4 matrix;
+        RunState state;
+        size_t first;   // m_queued での位置
+        size_t num;
+    };
+
+    // 描く順の segment の添字を m_order の前半に (後半は作業用)。layer の昇順で、同じ layer の中は積んだ順のままです
+    // 行列、フォント、縁取り/影は積んだ順を変えないようキーには入れず、行列と縁取り/影は描く時に変わる所で分けます
+    void sortSegments()
+    {
+        const size_t n = m_segments.size();
+        m_order.resize(n*2);
+        m_keys.resize(n);
+        bool sorted = true;
+        for(size_t i=0; i<n; ++i) {
+            m_keys[i] = LayerSortKey(m_segments[i].state.layer);
+            m_order[i] = uint32(i);
+            if(i>0 && m_keys[i]<m_keys[i-1]) { sorted=false; }
+        }
+        if(sorted) { return; }
+        StableRadixSort(&m_keys[0], &m_order[0], &m_order[n], n);
+    }
+
+    // slot のレイヤーを決めて、全フォントのシートを縦に積んだ atlas を作る。大きさが違うシートは右と下を 0 で埋めます
+    void buildAtlas(Image &atlas)
+    {
+        m_sheet_size = uvec2(0, 0);
+        m_num_layers = 0;
+        for(size_t i=0; i<m_slots.size(); ++i) {
+            const FontAsset &a = *m_slots[i]->asset;
+            m_slots[i]->base_layer = m_num_layers;
+            m_sheet_size = glm::max(m_sheet_size, uvec2(a.getAtlas().width(), a.getSheetHeight()));
+            m_num_layers += a.getNumSheets();
+        }
+        atlas.resize<R_8U>(m_sheet_size.x, m_sheet_size.y*m_num_layers);
+        if(atlas.size()>0) { ::memset(atlas.data(), 0, atlas.size()); }
+        for(size_t i=0; i<m_slots.size(); ++i) {
+            const FontAsset &a = *m_slots[i]->asset;
+            const Image &src = a.getAtlas();
+            const uint32 sheet_height = a.getSheetHeight();
+            for(uint32 l=0; l<a.getNumSheets(); ++l) {
+                for(uint32 y=0; y<sheet_height; ++y) {
+                    ::memcpy(&atlas.get<R_8U>((m_slots[i]->base_layer+l)*m_sheet_size.y+y, 0), &src.get<R_8U>(l*sheet_height+y, 0), src.width());
+                }
+            }
+        }
+        m_layout_dirty = false;
+    }
+
+    // m_queued の uv (フォント毎のシートを縦に積んだ座標) を、バッチのテクスチャのレイヤーを指すものに付け替えて m_order の順で m_merged に置く
+    void mergeQueued()
+    {
+        m_merged.resize(m_queued.size());
+        size_t pos = 0;
+        for(size_t oi=0; oi<m_segments.size(); ++oi) {
+            const Segment &seg = m_segments[m_order[oi]];
+            const uint32 sheet_height = seg.slot->asset->getSheetHeight();
+            const uint32 base = seg.slot->base_layer;
+            const FontQuad *src = &m_queued[seg.first];
+            FontQuad *dst = &m_merged[pos];
+            pos += seg.num;
+            for(size_t i=0; i<seg.num; ++i) {
+                const uint32 v = src[i].uv[1];
+                const uint32 layer = v/sheet_height;
+                dst[i] = src[i];
+                dst[i].uv[1] = uint16((base+layer)*m_sheet_size.y + (v-layer*sheet_height));
+            }
+        }
+    }
+
+    // 使われなくなった slot を外す。積んである文字がない時だけ呼ぶこと
+    void reclaimSlots()
+    {
+        for(size_t i=0; i<m_slots.size(); ) {
+            if(m_slots[i]->ref_count>0) { ++i; continue; }
+            g_font_registry.release(m_slots[i]->asset);
+            delete m_slots[i];
+            m_slots.erase(m_slots.begin()+i);
+            m_layout_dirty = true;
+        }
+    }
+
+    int m_flags;
+    GLFontBackend m_backend;
+    Texture2DArray *m_texture;      // 全フォントのシートを並べたもの
+    Sampler *m_sampler;
+    VertexShader *m_vs;
+    PixelShader *m_ps;
+    ShaderProgram *m_shader;
+    stl::vector<FontSlot*> m_slots;
+    uvec2 m_sheet_size;             // バッチのテクスチャの 1 レイヤーの大きさ
+    uint32 m_num_layers;
+    bool m_layout_dirty;            // slot が増減したので、次の flush() でテクスチャを作り直す
+    stl::vector<FontQuad> m_queued; // 積まれた順
+    stl::vector<Segment> m_segments;
+    stl::vector<uint32> m_order;    // 以下は flush() の作業用
+    stl::vector<uint32> m_keys;
+    stl::vector<FontQuad> m_merged; // 描く順
+    size_t m_peak_quad_capacity;
+    glIFR_FlushStats m_flush_stats[FlushStatsHistory];  // リングバッファ
+    size_t m_num_flush_stats;
+};
+
+
+// SpriteFontBatch で描く renderer の backend。flush() では描かずに、文字をバッチに積むだけです
+// 静的テキストも FontQuad のまま持っておき、位置と色を CPU で適用して積みます
+// renderer の統計は積んだ文字数のみで、描画の統計はバッチの getFlushStats() で取ります
+class BatchFontBackend : public FontBackend
+{
+public:
+    class BatchStaticBlock : public StaticBlock
+    {
+    public:
+        stl::vector<FontQuad> quads;
+    };
+
+    BatchFontBackend(SpriteFontBatch *batch) : m_batch(batch), m_slot(NULL) {}
+
+    ~BatchFontBackend()
+    {
+        if(m_slot) { m_batch->removeFont(m_slot); }
+    }
+
+    virtual bool initialize(FontAsset &asset)
+    {
+        m_slot = m_batch->addFont(asset);
+        return m_slot!=NULL;
+    }
+
+    virtual void setScreenMatrix(const mat4 &m) { m_matrix=m; }
+
+    virtual StaticBlock* createStaticBlock(const FontQuad *quads, size_t num_quad)
+    {
+        if(num_quad==0) { return NULL; }
+        BatchStaticBlock *block = new BatchStaticBlock();
+        block->quads.assign(quads, quads+num_quad);
+        return block;
+    }
+
+    virtual void beginFlush(glIFR_FlushStats &stats) {}
+
+    virtual void drawStaticBlock(StaticBlock *b, const vec2 &origin, const vec4 &color)
+    {
+        const BatchStaticBlock *block = static_cast<const BatchStaticBlock*>(b);
+        m_batch->submit(m_slot, m_matrix, m_state, &block->quads[0], block->quads.size(), origin, color);
+    }
+
+    virtual void drawQuads(const FontQuad *quads, size_t num_quad)
+    {
+        m_batch->submit(m_slot, m_matrix, m_state, quads, num_quad, vec2(0.0f), vec4(1.0f));
+    }
+
+    virtual void endFlush() {}
+
+    // 他のフォントの文字と合わせてバッチの flush() で並べ替えるので、layer 毎に分けて受け取る
+    virtual bool isLayered() const { return true; }
+    virtual void setLayer(int32 layer) { m_state.layer=layer; }
+    virtual void setEffect(const FontEffect &effect) { m_state.effect=effect; }
+
+private:
+    SpriteFontBatch *m_batch;
+    SpriteFontBatch::FontSlot *m_slot;
+    mat4 m_matrix;
+    RunState m_state;
+};
+
+
+class SpriteFontRenderer;
+
+// glIFontBuilder の実装。スタイルと FSS は builder 毎に持ち、文字は自前の m_quads に貯めておいて SpriteFontRenderer::flush() で回収されます
+// 使う側のスレッドと flush() する GL スレッドの間は m_mutex で守ります
+class SpriteFontBuilder : public glIFontBuilder
+{
+public:
+    // loading ならフォントの読み込み中。setFont() されるまで文字を貯めておきます
+    SpriteFontBuilder(SpriteFontRenderer *renderer, const SFFFont *font, const mat4 &screen, bool loading)
+        : m_renderer(renderer)
+        , m_loading(loading)
+        , m_add_text_ns(0)
+    {
+        m_fss.setFont(font);
+        m_fss.setScreenMatrix(screen);
+        m_state.screen = screen;
+    }
+
+    virtual void release();
+
+    virtual void setColor(float r, float g, float b, float a)   { m_fss.setColor(vec4(r,g,b,a)); }
+    virtual void setSize(float32 v)         { m_fss.setSize(v); }
+    virtual void setSpacing(float32 v)      { m_fss.setSpace(v); }
+    virtual void setMonospace(bool v)       { m_fss.setMonospace(v); }
+    virtual void setClipRect(float left, float top, float right, float bottom) { m_fss.setClipRect(vec4(left, top, right, bottom)); updateEffectClip(); }
+    virtual void clearClipRect()            { m_fss.clearClipRect(); updateEffectClip(); }
+    virtual void setLayer(int v)            { m_state.layer=v; }
+    virtual void setOutline(float width, float r, float g, float b, float a)        { m_state.effect.setOutline(width, vec4(r,g,b,a)); updateEffectClip(); }
+    virtual void setShadow(float x, float y, float r, float g, float b, float a)    { m_state.effect.setShadow(vec2(x,y), vec4(r,g,b,a)); updateEffectClip(); }
+
+    virtual void addText(float x, float y, const char *text, size_t len)
+    {
+        const uint64 t = GetTimeNS();
+        if(len==0) { len = strlen(text); }
+        ScopedLock lock(m_mutex);
+        if(m_loading)   { m_deferred.push(m_fss, m_state, vec2(x,y), text, len); }
+        else {
+            m_layers.mark(m_state, m_quads.size());
+            m_fss.makeQuadsUTF8(vec2(x,y), text, len, m_quads);
+        }
+        m_add_text_ns += GetTimeNS()-t;
+    }
+
+    virtual void addText(float x, float y, const wchar_t *text, size_t len)
+    {
+        const uint64 t = GetTimeNS();
+        if(len==0) { len=wcslen(text); }
+        ScopedLock lock(m_mutex);
+        if(m_loading)   { m_deferred.push(m_fss, m_state, vec2(x,y), text, len); }
+        else {
+            m_layers.mark(m_state, m_quads.size());
+            m_fss.makeQuads(vec2(x,y), text, len, m_quads);
+        }
+        m_add_text_ns += GetTimeNS()-t;
+    }
+
+    // 以下は SpriteFontRenderer から呼ばれます
+
+    // フォントの読み込みが終わった時。それまでに追加された文字をここで並べます。失敗していたら font は NULL
+    void setFont(const SFFFont *font)
+    {
+        ScopedLock lock(m_mutex);
+        m_fss.setFont(font);
+        m_deferred.replay(m_fss, m_quads, m_layers);
+        m_loading = false;
+    }
+
+    void setScreenMatrix(const mat4 &m)
+    {
+        ScopedLock lock(m_mutex);
+        m_state.screen = m;
+        m_fss.setScreenMatrix(m);
+        updateEffectClip();
+    }
+
+    // 貯まっている文字を dst の後ろに移し (layer の区切りは dst_layers へ)、addText() に掛かった時間を add_text_ns に足す
+    void takeQuads(stl::vector<FontQuad> &dst, LayerRuns &dst_layers, uint64 &add_text_ns)
+    {
+        ScopedLock lock(m_mutex);
+        dst_layers.append(m_layers, dst.size());
+        dst.insert(dst.end(), m_quads.begin(), m_quads.end());
+        m_quads.clear();
+        m_layers.clear();
+        add_text_ns += m_add_text_ns;
+        m_add_text_ns = 0;
+    }
+
+private:
+    // 縁取り/影のある文字の切り取りは backend に任せる。矩形は量子化した clip 座標なので、スクリーンが変わっても作り直します
+    void updateEffectClip()
+    {
+        m_fss.setClipMargin(m_state.effect.getClipMargin());
+        m_state.effect.clip_rect = m_fss.getPixelClipRect();
+    }
+
+    SpriteFontRenderer *m_renderer;
+    FSS m_fss;
+    RunState m_state;
+    stl::vector<FontQuad> m_quads;
+    LayerRuns m_layers;
+    bool m_loading;
+    DeferredTextQueue m_deferred;   // フォントの読み込み中に追加された文字
+    uint64 m_add_text_ns;
+    Mutex m_mutex;
+};
+
+
+// glIFontRenderer の実装。文字を並べて FontQuad の列にまとめるところまでを受け持ち、実際の描画は FontBackend に任せます
+class SpriteFontRenderer : public glIFontRenderer
+{
+public:
+    // createStaticText() で作る静的テキスト。文字は原点基準で並べて backend に置いたままにし、
+    // 移動/色変更/表示切り替えでは並べ直しません
+    struct StaticText
+    {
+        stl::vector<char> text;
+        bool wide;              // text が wchar_t か
+        float32 size;           // 作った時の設定。並べ直す時もこれを使う
+        float32 spacing;
+        bool monospace;
+        RunState state;         // layer と縁取り/影
+        vec2 pos;
+        vec4 color;
+        bool visible;
+        FontBackend::StaticBlock *block;    // 文字がなければ NULL
+        size_t num_quads;
+        bool layout_dirty;      // 並べ直して block を作り直す
+
+        StaticText()
+            : wide(false), size(0.0f), spacing(0.0f), monospace(false), visible(true)
+            , block(NULL), num_quads(0), layout_dirty(true)
+        {}
+        ~StaticText() { delete block; }
+    };
+
+public:
+    // getFlushStats() で返せる数
+    static const size_t FlushStatsHistory = 64;
+
+    // backend は renderer が破棄します
+    SpriteFontRenderer(FontBackend *backend)
+        : m_backend(backend)
+        , m_asset(NULL)
+        , m_loader(NULL)
+        , m_load_failed(false)
+        , m_color(1.0f, 1.0f, 1.0f, 1.0f)
+        , m_add_text_ns(0)
+        , m_peak_quad_capacity(0)
+        , m_num_flush_stats(0)
+    {
+    }
+
+    ~SpriteFontRenderer()
+    {
+        for(size_t i=0; i<m_builders.size(); ++i) { delete m_builders[i]; }
+        for(size_t i=0; i<m_static_texts.size(); ++i) { delete m_static_texts[i]; }
+        // backend は asset のテクスチャ等を参照しているので先に
+        delete m_backend;
+        if(m_loader) {
+            m_loader->join();
+            m_asset = m_loader->getAsset();
+            delete m_loader;
+        }
+        if(m_asset) { g_font_registry.release(m_asset); }
+    }
+
+    bool initialize(IBinaryStream &fss_stream, IBinaryStream &img_stream)
+    {
+        m_asset = g_font_registry.acquire(fss_stream, img_stream);
+        return initializeFont();
+    }
+
+    // 既に同じファイルから作った renderer があれば、読み込みは行わずにそれと共有します
+    bool initialize(const char *path_to_sff, const char *path_to_img)
+    {
+        m_asset = g_font_registry.acquire(path_to_sff, path_to_img);
+        return initializeFont();
+    }
+
+    // 読み込みは別スレッドで行い、終わった後の最初の flush() で backend に渡します (GL ならテクスチャの転送とシェーダのコンパイル)
+    // それまでに追加された文字や静的テキストは貯めておいて、その flush() で描きます
+    void initializeAsync(const char *path_to_sff, const char *path_to_img)
+    {
+        m_loader = new FontLoadThread(path_to_sff, path_to_img);
+        m_loader->run();
+    }
 
-        size_t wlen = mbstowcs(NULL, tmp.c_str(), 0);
-        if(wlen==size_t(-1)) { return; }
+    virtual glIFR_LoadState getLoadState() const
+    {
+        if(m_loader)        { return glIFR_Loading; }
+        if(m_load_failed)   { return glIFR_LoadFailed; }
+        return glIFR_Ready;
+    }
+
+    virtual void release() { delete this; }
+
+    // 追加済みの文字は追加した時点のスクリーンで量子化されていて、flush() でもそのスクリーンで描きます (RunState::screen)
+    virtual void setScreen(float32 left, float32 right, float32 bottom, float32 top)
+    {
+        const mat4 matrix = glm::ortho(left, right, bottom, top);
+        const vec2 prev_scale = m_fss.getPosScale();
+        m_fss.setScreenMatrix(matrix);
+        m_state.screen = matrix;
+        updateEffectClip();
+        {
+            ScopedLock lock(m_builders_mutex);
+            m_screen_matrix = matrix;
+            for(size_t i=0; i<m_builders.size(); ++i) { m_builders[i]->setScreenMatrix(m_screen_matrix); }
+        }
+        // キャッシュ済みの GlyphRun と静的テキストは拡大率込みで量子化されているので、変わったら作り直し
+        if(m_fss.getPosScale()!=prev_scale) {
+            m_run_cache.clear();
+            for(size_t i=0; i<m_static_texts.size(); ++i) {
+                if(StaticText *st = m_static_texts[i]) { st->layout_dirty=true; }
+            }
+        }
+    }
+    virtual void setColor(float r, float g, float b, float a)
+    {
+        m_color = vec4(r,g,b,a);
+        m_fss.setColor(m_color);
+    }
+    virtual void setSize(float32 v)         { m_fss.setSize(v); }
+    virtual void setSpacing(float32 v)      { m_fss.setSpace(v); }
+    virtual void setMonospace(bool v)       { m_fss.setMonospace(v); }
+    virtual void setClipRect(float left, float top, float right, float bottom) { m_fss.setClipRect(vec4(left, top, right, bottom)); updateEffectClip(); }
+    virtual void clearClipRect()            { m_fss.clearClipRect(); updateEffectClip(); }
+    virtual void setLayer(int v)            { m_state.layer=v; }
+    virtual void setOutline(float width, float r, float g, float b, float a)        { m_state.effect.setOutline(width, vec4(r,g,b,a)); updateEffectClip(); }
+    virtual void setShadow(float x, float y, float r, float g, float b, float a)    { m_state.effect.setShadow(vec2(x,y), vec4(r,g,b,a)); updateEffectClip(); }
+    virtual void setLayoutCacheBudget(size_t bytes)                 { m_run_cache.setBudget(bytes); }
+    virtual void getLayoutCacheStats(glIFR_LayoutCacheStats &out) const { m_run_cache.getStats(out); }
 
-        stl::wstring wtext;
-        wtext.resize(wlen);
-        mbstowcs(&wtext[0], tmp.c_str(), wlen);
-        addText(x,y, wtext.c_str(), wlen);
+    virtual void addText(float x, float y, const char *text, size_t len)
+    {
+        const uint64 t = GetTimeNS();
+        if(len==0) { len = strlen(text); }
+        if(m_loader)                { m_deferred.push(m_fss, m_state, vec2(x,y), text, len); }
+        else if(m_run_cache.isEnabled()) { addCachedText(vec2(x,y), text, len); }
+        else {
+            m_layers.mark(m_state, m_quads.size());
+            m_fss.makeQuadsUTF8(vec2(x,y), text, len, m_quads);
+        }
+        m_add_text_ns += GetTimeNS()-t;
     }
 
     virtual void addText(float x, float y, const wchar_t *text, size_t len)
+    {
+        const uint64 t = GetTimeNS();
+        if(len==0) { len=wcslen(text); }
+        if(m_loader)                { m_deferred.push(m_fss, m_state, vec2(x,y), text, len); }
+        else if(m_run_cache.isEnabled()) { addCachedText(vec2(x,y), text, len); }
+        else {
+            m_layers.mark(m_state, m_quads.size());
+            m_fss.makeQuads(vec2(x,y), text, len, m_quads);
+        }
+        m_add_text_ns += GetTimeNS()-t;
+    }
+
+    virtual glIFontBuilder* createBuilder()
+    {
+        ScopedLock lock(m_builders_mutex);
+        // 読み込み中ならフォントは finishLoading() で渡す
+        const SFFFont *font = (m_asset && !m_loader) ? &m_asset->getFont() : NULL;
+        SpriteFontBuilder *b = new SpriteFontBuilder(this, font, m_screen_matrix, m_loader!=NULL);
+        m_builders.push_back(b);
+        return b;
+    }
+
+    void releaseBuilder(SpriteFontBuilder *b)
+    {
+        {
+            ScopedLock lock(m_builders_mutex);
+            m_builders.erase(stl::find(m_builders.begin(), m_builders.end(), b));
+        }
+        delete b;
+    }
+
+    virtual int createStaticText(float x, float y, const char *text, size_t len)
+    {
+        if(len==0) { len=strlen(text); }
+        return createStaticText(vec2(x,y), text, len);
+    }
+
+    virtual int createStaticText(float x, float y, const wchar_t *text, size_t len)
     {
         if(len==0) { len=wcslen(text); }
-        m_fss.makeQuads(vec2(x,y), text, len, m_quads);
+        return createStaticText(vec2(x,y), text, len);
+    }
+
+    virtual void setStaticText(int handle, const char *text, size_t len)
+    {
+        if(StaticText *st = getStaticText(handle)) {
+            if(len==0) { len=strlen(text); }
+            assignStaticText(*st, text, len);
+        }
+    }
+
+    virtual void setStaticText(int handle, const wchar_t *text, size_t len)
+    {
+        if(StaticText *st = getStaticText(handle)) {
+            if(len==0) { len=wcslen(text); }
+            assignStaticText(*st, text, len);
+        }
+    }
+
+    virtual void moveStaticText(int handle, float x, float y)
+    {
+        if(StaticText *st = getStaticText(handle)) { st->pos=vec2(x,y); }
+    }
+
+    virtual void setStaticTextColor(int handle, float r, float g, float b, float a)
+    {
+        if(StaticText *st = getStaticText(handle)) { st->color=vec4(r,g,b,a); }
+    }
+
+    virtual void showStaticText(int handle, bool v)
+    {
+        if(StaticText *st = getStaticText(handle)) { st->visible=v; }
+    }
+
+    virtual void deleteStaticText(int handle)
+    {
+        if(StaticText *st = getStaticText(handle)) {
+            delete st;
+            m_static_texts[handle-1] = NULL;
+        }
+    }
+
+    virtual const unsigned char* getCanvas(int &width, int &height) const
+    {
+        const Image *canvas = m_backend->getCanvas();
+        if(canvas==NULL || canvas->size()==0) {
+            width = height = 0;
+            return NULL;
+        }
+        width = int(canvas->width());
+        height = int(canvas->height());
+        return (const unsigned char*)canvas->data();
+    }
+
+    virtual void clearCanvas(float r, float g, float b, float a)
+    {
+        if(Image *canvas = m_backend->getCanvas()) {
+            const vec4 c = glm::clamp(vec4(r,g,b,a), vec4(0.0f), vec4(1.0f))*255.0f + 0.5f;
+            stl::fill(canvas->begin<RGBA_8U>(), canvas->end<RGBA_8U>(), RGBA_8U(uint8(c.r), uint8(c.g), uint8(c.b), uint8(c.a)));
+        }
+    }
+
+    virtual bool saveCanvas(const char *path) const
+    {
+        const Image *canvas = m_backend->getCanvas();
+        return canvas!=NULL && canvas->save(path);
+    }
+
+    virtual size_t getFlushStats(glIFR_FlushStats *out, size_t max_count) const
+    {
+        const size_t n = stl::min<size_t>(max_count, stl::min<size_t>(m_num_flush_stats, FlushStatsHistory));
+        for(size_t i=0; i<n; ++i) {
+            out[i] = m_flush_stats[(m_num_flush_stats-1-i)%FlushStatsHistory];
+        }
+        return n;
     }
 
     virtual void flush()
     {
-        if(m_quads.empty()) { return; }
+        if(m_loader && !finishLoading()) { return; }
+        // 読み込みに失敗した時は backend が使えないので、貯まっている文字は捨てるだけ
+        if(m_load_failed) {
+            discardQuads();
+            return;
+        }
+        drawCollected();
+    }
 
-        m_shader->setUniformBlock(m_uniform_loc, 0, m_ubo->getHandle());
-        m_va->bind();
-        m_shader->bind();
-        m_sampler->bind(0);
-        m_texture->bind(0);
+private:
+    // builder の分も含めて貯まっている文字と静的テキストを描く
+    void drawCollected()
+    {
+        const uint64 flush_begin = GetTimeNS();
+        // builder の文字を作った順に回収。自身に addText() された分の後ろに並べます
+        {
+            ScopedLock lock(m_builders_mutex);
+            for(size_t i=0; i<m_builders.size(); ++i) { m_builders[i]->takeQuads(m_quads, m_layers, m_add_text_ns); }
+        }
 
-        size_t drawn_quads = 0;
-        for(;;) {
-            size_t num_quad = stl::min<size_t>(m_quads.size()-drawn_quads, MaxCharsPerDraw);
-            size_t num_vertex = num_quad*4;
-            {
-                VertexT *vertex = (VertexT*)m_vbo->map(GL_WRITE_ONLY);
-                for(size_t qi=0; qi<num_quad; ++qi) {
-                    const FontQuad &quad = m_quads[qi+drawn_quads];
-                    VertexT *v = &vertex[qi*4];
-                    const vec2 pos_min = quad.pos;
-                    const vec2 pos_max = quad.pos + quad.size;
-                    const vec2 tex_min = quad.uv_pos;
-                    const vec2 tex_max = quad.uv_pos + quad.uv_size;
-                    v[0] = VertexT(vec2(pos_min.x, pos_min.y), vec2(tex_min.x, tex_min.y), quad.color);
-                    v[1] = VertexT(vec2(pos_min.x, pos_max.y), vec2(tex_min.x, tex_max.y), quad.color);
-                    v[2] = VertexT(vec2(pos_max.x, pos_max.y), vec2(tex_max.x, tex_max.y), quad.color);
-                    v[3] = VertexT(vec2(pos_max.x, pos_min.y), vec2(tex_max.x, tex_min.y), quad.color);
+        m_visible_statics.clear();
+        for(size_t i=0; i<m_static_texts.size(); ++i) {
+            if(m_static_texts[i]!=NULL && m_static_texts[i]->visible) { m_visible_statics.push_back(m_static_texts[i]); }
+        }
+        if(m_quads.empty() && m_visible_statics.empty()) {
+            m_layers.clear();
+            return;
+        }
+
+        glIFR_FlushStats stats;
+        ::memset(&stats, 0, sizeof(stats));
+        stats.add_text_ms = double(m_add_text_ns)/1000000.0;
+        stats.gpu_ms = -1.0;
+        m_add_text_ns = 0;
+        m_peak_quad_capacity = stl::max<size_t>(m_peak_quad_capacity, m_quads.capacity());
+        stats.peak_quad_capacity = m_peak_quad_capacity;
+
+        // layer 順に並べ替える。同じ layer の中は静的テキスト、addText() の分の順で、addText() の分は追加した順のままです
+        m_layers.sort(m_quads, m_sorted_quads, m_layer_ranges);
+        sortStaticTexts();
+
+        // layer を区別しない backend には、間に静的テキストや縁取り/影、スクリーンの切り替えがなければ続く layer の文字もまとめて渡す
+        // 静的テキストは現在のスクリーンで、addText() の分は追加した時点のスクリーンで描きます
+        m_backend->beginFlush(stats);
+        const bool layered = m_backend->isLayered();
+        FontEffect effect;
+        m_backend->setEffect(effect);
+        mat4 screen = m_screen_matrix;
+        m_backend->setScreenMatrix(screen);
+        size_t ri = 0, si = 0;
+        size_t pending_first = 0, pending_num = 0;
+        while(ri<m_layer_ranges.size() || si<m_visible_statics.size()) {
+            const bool static_first = si<m_visible_statics.size() &&
+                (ri==m_layer_ranges.size() || m_visible_statics[si]->state.layer<=m_layer_ranges[ri].state.layer);
+            const int32 layer = static_first ? m_visible_statics[si]->state.layer : m_layer_ranges[ri].state.layer;
+            if(pending_num>0 && (layered || static_first)) {
+                m_backend->drawQuads(&m_quads[pending_first], pending_num);
+                pending_num = 0;
+            }
+            m_backend->setLayer(layer);
+            // 変更がなければ並べ直しは発生しません
+            for(; si<m_visible_statics.size() && m_visible_statics[si]->state.layer==layer; ++si) {
+                StaticText *st = m_visible_statics[si];
+                if(screen!=m_screen_matrix) {
+                    screen = m_screen_matrix;
+                    m_backend->setScreenMatrix(screen);
+                }
+                if(st->layout_dirty) { buildStaticText(*st); }
+                if(st->block==NULL) { continue; }
+                if(st->state.effect!=effect) {
+                    effect = st->state.effect;
+                    m_backend->setEffect(effect);
                 }
-                m_vbo->unmap();
+                const vec2 origin = glm::floor(st->pos*m_fss.getPosScale() + m_fss.getPosOffset() + 0.5f);
+                m_backend->drawStaticBlock(st->block, origin, st->color);
+                stats.glyphs_submitted += st->num_quads;
             }
-            MapAndWrite(*m_ubo, &m_renderstate, sizeof(m_renderstate));
+            for(; ri<m_layer_ranges.size() && m_layer_ranges[ri].state.layer==layer; ++ri) {
+                const LayerRuns::Range &range = m_layer_ranges[ri];
+                if(range.state.effect!=effect || range.state.screen!=screen) {
+                    if(pending_num>0) {
+                        m_backend->drawQuads(&m_quads[pending_first], pending_num);
+                        pending_num = 0;
+                    }
+                    if(range.state.effect!=effect) {
+                        effect = range.state.effect;
+                        m_backend->setEffect(effect);
+                    }
+                    if(range.state.screen!=screen) {
+                        screen = range.state.screen;
+                        m_backend->setScreenMatrix(screen);
+                    }
+                }
+                if(pending_num==0) { pending_first = range.first; }
+                pending_num += range.num;
+            }
+        }
+        if(pending_num>0) {
+            m_backend->drawQuads(&m_quads[pending_first], pending_num);
+        }
+        stats.glyphs_submitted += m_quads.size();
+        m_backend->endFlush();
+        m_quads.clear();
+        m_layers.clear();
 
-            glDrawArrays(GL_QUADS, 0, num_vertex);
+        stats.flush_ms = double(GetTimeNS()-flush_begin)/1000000.0;
+        m_flush_stats[m_num_flush_stats%FlushStatsHistory] = stats;
+        ++m_num_flush_stats;
+    }
 
-            drawn_quads += num_quad;
-            if(drawn_quads==m_quads.size()) { break; }
+    // キャッシュにあれば平行移動と色の差し替えだけ、なければ原点基準で並べてキャッシュに入れてから配置します
+    // キャッシュの有無で位置の丸め方が変わらないよう、ミス時も同じ経路を通します
+    template<class CharT>
+    void addCachedText(const vec2 &pos, const CharT *text, size_t len)
+    {
+        m_layers.mark(m_state, m_quads.size());
+        const uint64 hash = GlyphRunCache::hash(m_fss, text, len);
+        if(const GlyphRun *run = m_run_cache.find(hash, m_fss, text, len)) {
+            m_fss.placeGlyphRun(pos, *run, m_quads);
+            return;
+        }
+        GlyphRun &run = m_run_cache.insert(hash, m_fss, text, len);
+        appendGlyphRun(run, text, len);
+        m_fss.placeGlyphRun(pos, run, m_quads);
+        m_run_cache.commit();
+    }
+
+    void appendGlyphRun(GlyphRun &run, const char *text, size_t len)
+    {
+        // UTF-8
+        const char *end = text+len;
+        uint32 buf[256];
+        while(text<end) {
+            size_t n = DecodeUTF8(text, end, buf, _countof(buf));
+            m_fss.appendGlyphRun(run, buf, n);
+        }
+    }
+
+    void appendGlyphRun(GlyphRun &run, const wchar_t *text, size_t len)
+    {
+        m_fss.appendGlyphRun(run, text, len);
+    }
+
+    // m_visible_statics を layer の昇順に。同じ layer の中は作った順 (ハンドル順) のままです
+    void sortStaticTexts()
+    {
+        const size_t n = m_visible_statics.size();
+        if(n<2) { return; }
+        m_static_keys.resize(n);
+        m_static_order.resize(n*2);
+        for(size_t i=0; i<n; ++i) {
+            m_static_keys[i] = LayerSortKey(m_visible_statics[i]->state.layer);
+            m_static_order[i] = uint32(i);
+        }
+        StableRadixSort(&m_static_keys[0], &m_static_order[0], &m_static_order[n], n);
+        m_sorted_statics.resize(n);
+        for(size_t i=0; i<n; ++i) { m_sorted_statics[i] = m_visible_statics[m_static_order[i]]; }
+        m_visible_statics.swap(m_sorted_statics);
+    }
+
+    StaticText* getStaticText(int handle)
+    {
+        if(handle<=0 || size_t(handle)>m_static_texts.size()) { return NULL; }
+        return m_static_texts[handle-1];
+    }
+
+    // ハンドルは m_static_texts の添字 + 1。消されて空いた所は使い回します
+    template<class CharT>
+    int createStaticText(const vec2 &pos, const CharT *text, size_t len)
+    {
+        if(m_load_failed) { return 0; }
+        StaticText *st = new StaticText();
+        st->pos = pos;
+        st->color = m_color;
+        st->state = m_state;
+        st->state.effect.clip_rect = FontQuadPosRange();   // 静的テキストは切り取らない
+        assignStaticText(*st, text, len);
+
+        stl::vector<StaticText*>::iterator i = stl::find(m_static_texts.begin(), m_static_texts.end(), (StaticText*)NULL);
+        if(i!=m_static_texts.end()) {
+            *i = st;
+            return int(i-m_static_texts.begin())+1;
+        }
+        m_static_texts.push_back(st);
+        return int(m_static_texts.size());
+    }
+
+    template<class CharT>
+    void assignStaticText(StaticText &st, const CharT *text, size_t len)
+    {
+        st.text.assign((const char*)text, (const char*)(text+len));
+        st.wide = sizeof(CharT)!=sizeof(char);
+        st.size = m_fss.getSize();
+        st.spacing = m_fss.getSpacing();
+        st.monospace = m_fss.isMonospace();
+        st.layout_dirty = true;
+    }
+
+
+    bool initializeFont()
+    {
+        if(m_asset==NULL || !m_backend->initialize(*m_asset)) { return false; }
+        m_fss.setFont(&m_asset->getFont());
+        m_backend->setScreenMatrix(m_screen_matrix);
+        return true;
+    }
+
+    // 非同期読み込みが終わっていれば backend を初期化し、貯めておいた文字を並べる。まだなら false
+    // 失敗した時は m_load_failed を立てて、貯めておいた文字と静的テキストを捨てます
+    bool finishLoading()
+    {
+        if(!m_loader->isDone()) { return false; }
+        m_loader->join();
+        m_asset = m_loader->getAsset();
+        delete m_loader;
+        m_loader = NULL;
+        const bool succeeded = initializeFont();
+        m_load_failed = !succeeded;
+        if(!succeeded) {
+            {
+                ScopedLock lock(m_builders_mutex);
+                for(size_t i=0; i<m_builders.size(); ++i) { m_builders[i]->setFont(NULL); }
+            }
+            m_deferred.clear();
+            for(size_t i=0; i<m_static_texts.size(); ++i) {
+                delete m_static_texts[i];
+                m_static_texts[i] = NULL;
+            }
+            return true;
+        }
+
+        // 読み込み中に setScreen() されていても、文字は RunState::screen で追加した時点のスクリーンで描かれます
+        const SFFFont *font = &m_asset->getFont();
+        {
+            ScopedLock lock(m_builders_mutex);
+            for(size_t i=0; i<m_builders.size(); ++i) { m_builders[i]->setFont(font); }
+        }
+        m_deferred.replay(m_fss, m_quads, m_layers);
+        for(size_t i=0; i<m_static_texts.size(); ++i) {
+            StaticText *st = m_static_texts[i];
+            if(st!=NULL && st->size==0.0f) { st->size=font->getFontSize(); }
+        }
+        return true;
+    }
+
+    // 描かずに捨てる。builder の分も
+    void discardQuads()
+    {
+        {
+            ScopedLock lock(m_builders_mutex);
+            for(size_t i=0; i<m_builders.size(); ++i) { m_builders[i]->takeQuads(m_quads, m_layers, m_add_text_ns); }
         }
         m_quads.clear();
+        m_layers.clear();
+        m_add_text_ns = 0;
     }
 
-private:
+    // 作った時の設定で原点基準に並べ、backend 側のデータを作り直す
+    // SpriteFontBuilder::updateEffectClip() と同じ
+    void updateEffectClip()
+    {
+        m_fss.setClipMargin(m_state.effect.getClipMargin());
+        m_state.effect.clip_rect = m_fss.getPixelClipRect();
+    }
+
+    void buildStaticText(StaticText &st)
+    {
+        const float32 size = m_fss.getSize();
+        const float32 spacing = m_fss.getSpacing();
+        const bool monospace = m_fss.isMonospace();
+        m_fss.setSize(st.size);
+        m_fss.setSpace(st.spacing);
+        m_fss.setMonospace(st.monospace);
+        GlyphRun run;
+        if(!st.text.empty()) {
+            if(st.wide) { appendGlyphRun(run, (const wchar_t*)&st.text[0], st.text.size()/sizeof(wchar_t)); }
+            else        { appendGlyphRun(run, &st.text[0], st.text.size()); }
+        }
+        m_fss.setSize(size);
+        m_fss.setSpace(spacing);
+        m_fss.setMonospace(monospace);
+
+        // 色は描く時に掛けるので白にしておく
+        for(size_t i=0; i<run.quads.size(); ++i) { run.quads[i].color=0xffffffff; }
+
+        delete st.block;
+        st.block = m_backend->createStaticBlock(run.quads.empty() ? NULL : &run.quads[0], run.quads.size());
+        st.num_quads = run.quads.size();
+        st.layout_dirty = false;
+    }
+
+    FontBackend *m_backend;
+    FontAsset *m_asset;     // FontRegistry から借りているもの
+    FontLoadThread *m_loader;   // 非同期読み込み中なら非 NULL
+    bool m_load_failed;
+    DeferredTextQueue m_deferred;   // 読み込み中に addText() された文字
     FSS m_fss;
+    GlyphRunCache m_run_cache;
+    stl::vector<SpriteFontBuilder*> m_builders;    // 作った順
+    Mutex m_builders_mutex;
+    mat4 m_screen_matrix;                           // 書き換えは m_builders_mutex 内で
     stl::vector<FontQuad> m_quads;
-    Sampler *m_sampler;
-    Texture2D *m_texture;
-    Buffer *m_vbo;
-    Buffer *m_ubo;
-    VertexArray *m_va;
-    VertexShader *m_vs;
-    PixelShader *m_ps;
-    ShaderProgram *m_shader;
-    GLint m_uniform_loc;
-    RenderState m_renderstate;
+    LayerRuns m_layers;                             // m_quads の layer の区切り
+    stl::vector<FontQuad> m_sorted_quads;           // 以下は flush() の作業用
+    stl::vector<LayerRuns::Range> m_layer_ranges;
+    stl::vector<StaticText*> m_visible_statics;
+    stl::vector<StaticText*> m_sorted_statics;
+    stl::vector<uint32> m_static_keys;
+    stl::vector<uint32> m_static_order;
+    stl::vector<StaticText*> m_static_texts;
+    vec4 m_color;
+    RunState m_state;
+    uint64 m_add_text_ns;       // 前回の flush() 以降の addText() の時間
+    size_t m_peak_quad_capacity;
+    glIFR_FlushStats m_flush_stats[FlushStatsHistory];  // リングバッファ
+    size_t m_num_flush_stats;   // これまでの flush() の数 (記録したもの)
 };
+
+void SpriteFontBuilder::release()
+{
+    m_renderer->releaseBuilder(this);
+}
+
 } // namespace ist
 
 
-glIFontRenderer* CreateGLSpriteFont(ist::IBinaryStream &sff, ist::IBinaryStream &img)
+static glIFontRenderer* CreateSpriteFont(ist::FontBackend *backend, ist::IBinaryStream &sff, ist::IBinaryStream &img)
 {
-    static bool s_glew_initialized = false;
-    if(!s_glew_initialized) {
-        glewInit();
-        ::setlocale(LC_ALL, ""); // mbstowcs() のため
+    ist::SpriteFontRenderer *r = new ist::SpriteFontRenderer(backend);
+    if(!r->initialize(sff, img)) {
+        r->release();
+        return NULL;
     }
+    return r;
+}
 
-    ist::SpriteFontRenderer *r = new ist::SpriteFontRenderer();
-    if(!r->initialize(sff, img)) {
+static glIFontRenderer* CreateSpriteFont(ist::FontBackend *backend, const char *path_to_sff, const char *path_to_img)
+{
+    ist::SpriteFontRenderer *r = new ist::SpriteFontRenderer(backend);
+    if(!r->initialize(path_to_sff, path_to_img)) {
         r->release();
         return NULL;
     }
     return r;
 }
 
-glIFontRenderer* CreateGLSpriteFont(const char *path_to_sff, const char *path_to_img)
+glIFontRenderer* CreateGLSpriteFont(ist::IBinaryStream &sff, ist::IBinaryStream &img, int flags)
+{
+    return CreateSpriteFont(new ist::GLFontBackend(flags), sff, img);
+}
+
+glIFontRenderer* CreateGLSpriteFont(const char *path_to_sff, const char *path_to_img, int flags)
+{
+    return CreateSpriteFont(new ist::GLFontBackend(flags), path_to_sff, path_to_img);
+}
+
+glIFontRenderer* ist::SpriteFontBatch::createFont(const char *path_to_sff, const char *path_to_img)
+{
+    return CreateSpriteFont(new BatchFontBackend(this), path_to_sff, path_to_img);
+}
+
+glIFontBatch* CreateGLSpriteFontBatch(int flags)
+{
+    ist::SpriteFontBatch *b = new ist::SpriteFontBatch(flags);
+    if(!b->initialize()) {
+        b->release();
+        return NULL;
+    }
+    return b;
+}
+
+glIFontRenderer* CreateGLSpriteFontAsync(const char *path_to_sff, const char *path_to_img, int flags)
+{
+    ist::SpriteFontRenderer *r = new ist::SpriteFontRenderer(new ist::GLFontBackend(flags));
+    r->initializeAsync(path_to_sff, path_to_img);
+    return r;
+}
+
+
+glIFontRenderer* CreateSoftwareSpriteFont(ist::IBinaryStream &sff, ist::IBinaryStream &img, int width, int height)
+{
+    if(width<=0 || height<=0) { return NULL; }
+    glIFontRenderer *r = CreateSpriteFont(new ist::SoftwareFontBackend(width, height), sff, img);
+    if(r) { r->setScreen(0.0f, float32(width), float32(height), 0.0f); }
+    return r;
+}
+
+glIFontRenderer* CreateSoftwareSpriteFont(const char *path_to_sff, const char *path_to_img, int width, int height)
+{
+    if(width<=0 || height<=0) { return NULL; }
+    glIFontRenderer *r = CreateSpriteFont(new ist::SoftwareFontBackend(width, height), path_to_sff, path_to_img);
+    if(r) { r->setScreen(0.0f, float32(width), float32(height), 0.0f); }
+    return r;
+}
+
+
+glIFontRenderer* CreateNullSpriteFont(ist::IBinaryStream &sff, ist::IBinaryStream &img)
+{
+    return CreateSpriteFont(new ist::NullFontBackend(), sff, img);
+}
+
+glIFontRenderer* CreateNullSpriteFont(const char *path_to_sff, const char *path_to_img)
 {
-    ist::FileStream sff(path_to_sff, "rb");
-    ist::FileStream img(path_to_img, "rb");
-    if(!sff.isOpened()) { istPrint("%s load failed\n", path_to_sff); return NULL; }
-    if(!img.isOpened()) { istPrint("%s load failed\n", path_to_img); return NULL; }
-    return CreateGLSpriteFont(sff, img);
+    return CreateSpriteFont(new ist::NullFontBackend(), path_to_sff, path_to_img);
 }
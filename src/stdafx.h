@@ -26,6 +26,7 @@
 #define __ist_with_zlib__
 #define __ist_with_png__
 #define __ist_with_gli__
+#define __ist_with_SSE__
 
 #ifdef __ist_with_EASTL__
 #   include <EASTL/algorithm.h>
@@ -39,6 +40,7 @@ namespace stl = eastl;
 #else // __ist_with_EASTL__
 #   include <vector>
 #   include <list>
+#   include <set>
 #   include <map>
 #   include <string>
 #   include <algorithm>
@@ -66,6 +68,10 @@ namespace stl = std;
 #   pragma comment(lib,"libpng15s.lib")
 #endif // __ist_with_png__
 
+#ifdef __ist_with_SSE__
+#   include <emmintrin.h>
+#endif // __ist_with_SSE__
+
 #ifdef __ist_with_jpeg__
 #   include <jpeglib.h>
 #   include <jerror.h>
@@ -84,6 +90,7 @@ typedef float               float32;
 using glm::vec2;
 using glm::ivec2;
 using glm::uvec2;
+using glm::uvec3;
 using glm::vec4;
 using glm::ivec4;
 using glm::uvec4;
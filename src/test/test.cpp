@@ -99,8 +99,9 @@ public:
         m_font->setSize(24.0f);
 
         m_font->setColor(1.0f, 1.0f, 1.0f, 1.0f);
-        m_font->addText(10.0f, 10.0f, "ABCDEFGあいうえお");
-        m_font->addText(10.0f, 40.0f, "やったー！日本語出たよー！");
+        // char 版は UTF-8 として扱われます。ソースの文字コードに依存しないように ASCII 以外は wchar_t 版で
+        m_font->addText(10.0f, 10.0f, "ABCDEFG");
+        m_font->addText(10.0f, 40.0f, L"やったー！日本語出たよー！");
 
         m_font->setColor(0.6f, 0.6f, 1.0f, 1.0f);
         m_font->addText(10.0f, 70.0f, L"文字色変更");
@@ -114,7 +115,7 @@ public:
         m_font->setMonospace(true);
         m_font->setSpacing(0.75f);
         m_font->addText(10.0f, 130.0f, L"以下等幅");
-        m_font->addText(10.0f, 160.0f, "ABCDEFGあいうえお");
+        m_font->addText(10.0f, 160.0f, L"ABCDEFGあいうえお");
 
         m_font->setSpacing(1.2f);
         m_font->addText(10.0f, 190.0f, L"スペース幅変更");